@@ -21,7 +21,9 @@
 #ifndef _CONTINUATION_H_
 #define _CONTINUATION_H_
 
+#if !WITH_ASM
 #include <ucontext.h>
+#endif
 #include <stddef.h>
 
 struct continuation
@@ -32,8 +34,13 @@ struct continuation
     int (*release)(struct continuation *cc);
 
     /* private */
+#if WITH_ASM
+    void *sp; /* Saved stack pointer while switched out */
+    struct continuation *last; /* Resumed when entry returns */
+#else
     ucontext_t uc;
     ucontext_t last;
+#endif
     int exited;
 };
 
@@ -0,0 +1,146 @@
+/*
+ * GTK VNC Widget
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "continuation.h"
+
+/*
+ * Switches stacks by saving just the registers the calling
+ * convention requires a callee to preserve, on the stack
+ * being left, and popping them off the stack being entered.
+ * Unlike swapcontext() there is no signal mask to save and
+ * restore, so no system call on each switch
+ *
+ * cc_switch stores the current stack pointer in *save and
+ * resumes whatever was saved in 'sp'. cc_start is where a
+ * new stack first resumes, calling the function held in a
+ * callee saved register, with the other as its argument
+ */
+G_GNUC_INTERNAL void cc_switch(void **save, void *sp);
+G_GNUC_INTERNAL void cc_start(void);
+
+#if defined(__x86_64__)
+
+__asm__(
+    ".text\n"
+    ".globl cc_switch\n"
+    ".hidden cc_switch\n"
+    ".type cc_switch, @function\n"
+    ".p2align 4\n"
+    "cc_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size cc_switch, .-cc_switch\n"
+    "\n"
+    ".globl cc_start\n"
+    ".hidden cc_start\n"
+    ".type cc_start, @function\n"
+    ".p2align 4\n"
+    "cc_start:\n"
+    "    movq %r12, %rdi\n"
+    "    jmpq *%r13\n"
+    ".size cc_start, .-cc_start\n"
+);
+
+/* r15, r14, r13, r12, rbx, rbp, return address, and the
+ * return address of the first function, which is never used */
+#define CC_FRAME_SLOTS 8
+#define CC_FRAME_ARG 3
+#define CC_FRAME_FUNC 2
+#define CC_FRAME_RESUME 6
+
+#else
+#error "No assembly context switch for this architecture"
+#endif
+
+static void continuation_trampoline(struct continuation *cc)
+{
+    cc->entry(cc);
+
+    /* Back to whoever last switched to us, for good */
+    cc->exited = 1;
+    cc_switch(&cc->sp, cc->last->sp);
+    abort();
+}
+
+int cc_init(struct continuation *cc)
+{
+    guintptr top = ((guintptr)cc->stack + cc->stack_size) & ~(guintptr)15;
+    void **frame = (void **)top - CC_FRAME_SLOTS;
+
+    memset(frame, 0, CC_FRAME_SLOTS * sizeof(void *));
+    frame[CC_FRAME_ARG] = cc;
+    frame[CC_FRAME_FUNC] = (void *)continuation_trampoline;
+    frame[CC_FRAME_RESUME] = (void *)cc_start;
+
+    cc->sp = frame;
+    cc->last = NULL;
+    cc->exited = 0;
+
+    return 0;
+}
+
+int cc_release(struct continuation *cc)
+{
+    if (cc->release)
+        return cc->release(cc);
+
+    return 0;
+}
+
+/*
+ * Returns 0 once something switches back to 'from', or
+ * 1 if that happened because the entry function of 'to'
+ * returned
+ */
+int cc_swap(struct continuation *from, struct continuation *to)
+{
+    to->exited = 0;
+    to->last = from;
+
+    cc_switch(&from->sp, to->sp);
+
+    return to->exited;
+}
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ * End:
+ */
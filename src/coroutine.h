@@ -23,7 +23,7 @@
 
 #include "config.h"
 
-#if WITH_UCONTEXT
+#if WITH_UCONTEXT || WITH_ASM
 #include "continuation.h"
 #else
 #include <glib.h>
@@ -42,7 +42,7 @@ struct coroutine
     struct coroutine *caller;
     void *data;
 
-#if WITH_UCONTEXT
+#if WITH_UCONTEXT || WITH_ASM
     struct continuation cc;
 #else
     GThread *thread;
@@ -54,6 +54,9 @@ int coroutine_init(struct coroutine *co);
 
 int coroutine_release(struct coroutine *co);
 
+/* Most bytes of stack used so far, or 0 if unknown */
+size_t coroutine_stack_used(struct coroutine *co);
+
 void *coroutine_swap(struct coroutine *from, struct coroutine *to, void *arg);
 
 struct coroutine *coroutine_self(void);
@@ -111,6 +111,12 @@ int coroutine_release(struct coroutine *co G_GNUC_UNUSED)
     return 0;
 }
 
+/* Thread stacks are not visible to us */
+size_t coroutine_stack_used(struct coroutine *co G_GNUC_UNUSED)
+{
+    return 0;
+}
+
 void *coroutine_swap(struct coroutine *from, struct coroutine *to, void *arg)
 {
     from->runnable = FALSE;
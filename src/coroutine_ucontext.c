@@ -25,8 +25,106 @@
 #include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "coroutine.h"
 
+/*
+ * Stacks of finished coroutines are kept for reuse, up to
+ * this many, instead of being unmapped. Their pages are
+ * handed back to the kernel, so an idle stack only costs
+ * address space
+ */
+#define COROUTINE_STACK_POOL_MAX 16
+
+struct coroutine_stack
+{
+    char *base; /* Start of the mapping, including the guard page */
+    size_t size; /* Usable size, above the guard page */
+};
+
+G_LOCK_DEFINE_STATIC(stack_pool);
+static GSList *stack_pool;
+static guint stack_pool_len;
+
+static size_t coroutine_page_size(void)
+{
+    static size_t page_size;
+
+    if (page_size == 0)
+        page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+/*
+ * Get a stack of 'size' bytes, from the pool if one that
+ * size is free. Below the stack is a page which can't be
+ * accessed, so an overflow faults instead of silently
+ * corrupting whatever is mapped next to it
+ */
+static char *coroutine_stack_get(size_t size)
+{
+    size_t page = coroutine_page_size();
+    struct coroutine_stack *stack = NULL;
+    GSList *tmp;
+    char *base;
+
+    G_LOCK(stack_pool);
+    for (tmp = stack_pool; tmp; tmp = tmp->next) {
+        struct coroutine_stack *s = tmp->data;
+        if (s->size == size) {
+            stack = s;
+            stack_pool = g_slist_delete_link(stack_pool, tmp);
+            stack_pool_len--;
+            break;
+        }
+    }
+    G_UNLOCK(stack_pool);
+
+    if (stack) {
+        base = stack->base;
+        g_free(stack);
+        return base + page;
+    }
+
+    base = mmap(0, size + page,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (mprotect(base, page, PROT_NONE) < 0) {
+        munmap(base, size + page);
+        return NULL;
+    }
+
+    return base + page;
+}
+
+static void coroutine_stack_put(char *sp, size_t size)
+{
+    size_t page = coroutine_page_size();
+    struct coroutine_stack *stack;
+
+    /* Drop the pages touched, so the next user starts from
+     * zero filled memory and the memory is not held idle */
+    madvise(sp, size, MADV_DONTNEED);
+
+    G_LOCK(stack_pool);
+    if (stack_pool_len >= COROUTINE_STACK_POOL_MAX) {
+        G_UNLOCK(stack_pool);
+        munmap(sp - page, size + page);
+        return;
+    }
+
+    stack = g_new0(struct coroutine_stack, 1);
+    stack->base = sp - page;
+    stack->size = size;
+    stack_pool = g_slist_prepend(stack_pool, stack);
+    stack_pool_len++;
+    G_UNLOCK(stack_pool);
+}
+
 int coroutine_release(struct coroutine *co)
 {
     return cc_release(&co->cc);
@@ -42,7 +140,7 @@ static int _coroutine_release(struct continuation *cc)
             return ret;
     }
 
-    munmap(co->cc.stack, co->cc.stack_size);
+    coroutine_stack_put(co->cc.stack, co->cc.stack_size);
 
     co->caller = NULL;
 
@@ -57,15 +155,15 @@ static void coroutine_trampoline(struct continuation *cc)
 
 int coroutine_init(struct coroutine *co)
 {
+    size_t page = coroutine_page_size();
+
     if (co->stack_size == 0)
         co->stack_size = 16 << 20;
+    co->stack_size = (co->stack_size + page - 1) & ~(page - 1);
 
     co->cc.stack_size = co->stack_size;
-    co->cc.stack = mmap(0, co->stack_size,
-                        PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_ANONYMOUS,
-                        -1, 0);
-    if (co->cc.stack == MAP_FAILED)
+    co->cc.stack = coroutine_stack_get(co->stack_size);
+    if (co->cc.stack == NULL)
         g_error("Failed to allocate %u bytes for coroutine stack",
                 (unsigned)co->stack_size);
     co->cc.entry = coroutine_trampoline;
@@ -75,6 +173,35 @@ int coroutine_init(struct coroutine *co)
     return cc_init(&co->cc);
 }
 
+/*
+ * Stacks grow down and pages are only backed by memory
+ * once touched, so the deepest page still resident gives
+ * the most stack used so far
+ */
+size_t coroutine_stack_used(struct coroutine *co)
+{
+    size_t page = coroutine_page_size();
+    size_t npages = co->cc.stack_size / page;
+    unsigned char *vec;
+    size_t i, used = 0;
+
+    if (co->cc.stack == NULL || npages == 0)
+        return 0;
+
+    vec = g_new0(unsigned char, npages);
+    if (mincore(co->cc.stack, co->cc.stack_size, (void *)vec) == 0) {
+        for (i = 0; i < npages; i++) {
+            if (vec[i] & 1) {
+                used = co->cc.stack_size - (i * page);
+                break;
+            }
+        }
+    }
+    g_free(vec);
+
+    return used;
+}
+
 #if 0
 static __thread struct coroutine leader;
 static __thread struct coroutine *current;
@@ -22,6 +22,7 @@
 #define GVNC_H
 
 #include <vncbaseframebuffer.h>
+#include <vncmemfdframebuffer.h>
 #include <vncconnectionenums.h>
 #include <vnccursor.h>
 #include <vncpixelformat.h>
@@ -26,6 +26,11 @@
 #include "vncbaseframebuffer.h"
 #include "vncutil.h"
 
+#if GLIB_CHECK_VERSION(2, 31, 0)
+#define g_mutex_new() g_new0(GMutex, 1)
+#define g_mutex_free(m) g_free(m)
+#endif
+
 typedef void vnc_base_framebuffer_blt_func(VncBaseFramebufferPrivate *priv,
                                            guint8 *src,
                                            int rowstride,
@@ -75,6 +80,14 @@ struct _VncBaseFramebufferPrivate {
     vnc_base_framebuffer_fill_func *fill;
     vnc_base_framebuffer_blt_func *blt;
     vnc_base_framebuffer_rgb24_blt_func *rgb24_blt;
+
+    /* One byte per VNC_BASE_FRAMEBUFFER_DAMAGE_TILE square,
+     * non-zero if it has been drawn to since last fetched */
+    GMutex *damageLock;
+    guint8 *damage;
+    guint damageCols;
+    guint damageRows;
+    gboolean damaged;
 };
 
 #define VNC_BASE_FRAMEBUFFER_AT(priv, x, y)                             \
@@ -211,6 +224,8 @@ static void vnc_base_framebuffer_finalize(GObject *object)
         vnc_pixel_format_free(priv->remoteFormat);
     if (priv->colorMap)
         vnc_color_map_free(priv->colorMap);
+    g_free(priv->damage);
+    g_mutex_free(priv->damageLock);
 
     G_OBJECT_CLASS(vnc_base_framebuffer_parent_class)->finalize (object);
 }
@@ -328,6 +343,8 @@ void vnc_base_framebuffer_init(VncBaseFramebuffer *fb)
 
     priv->localFormat = vnc_pixel_format_new();
     priv->remoteFormat = vnc_pixel_format_new();
+
+    priv->damageLock = g_mutex_new();
 }
 
 
@@ -366,6 +383,78 @@ VncBaseFramebuffer *vnc_base_framebuffer_new(guint8 *buffer,
 }
 
 
+/**
+ * vnc_base_framebuffer_fetch_damage:
+ * @fb: (transfer none): the framebuffer object
+ * @tiles: (out) (transfer full) (array) (allow-none): filled with the damage map
+ * @cols: (out) (allow-none): filled with the number of tile columns
+ * @rows: (out) (allow-none): filled with the number of tile rows
+ *
+ * Atomically fetch and clear the record of which parts of
+ * the framebuffer have been drawn to since the last call.
+ * The framebuffer is split into a grid of square tiles,
+ * VNC_BASE_FRAMEBUFFER_DAMAGE_TILE pixels on each side,
+ * with the right and bottom edges possibly smaller. On
+ * return @tiles holds one byte for each tile, in row order,
+ * which is non-zero if that tile was damaged. It should be
+ * released with g_free when no longer required.
+ *
+ * Returns: TRUE if any tile was damaged, FALSE if nothing
+ * has changed, in which case @tiles is set to NULL
+ */
+gboolean vnc_base_framebuffer_fetch_damage(VncBaseFramebuffer *fb,
+                                           guint8 **tiles,
+                                           guint *cols,
+                                           guint *rows)
+{
+    VncBaseFramebufferPrivate *priv = fb->priv;
+    gboolean damaged;
+
+    g_mutex_lock(priv->damageLock);
+
+    damaged = priv->damaged;
+    if (cols)
+        *cols = priv->damageCols;
+    if (rows)
+        *rows = priv->damageRows;
+
+    if (tiles) {
+        *tiles = NULL;
+        if (damaged) {
+            /* hand over the current map and start a fresh one */
+            *tiles = priv->damage;
+            priv->damage = g_new0(guint8, priv->damageCols * priv->damageRows);
+        }
+    } else if (damaged) {
+        memset(priv->damage, 0, priv->damageCols * priv->damageRows);
+    }
+    priv->damaged = FALSE;
+
+    g_mutex_unlock(priv->damageLock);
+
+    return damaged;
+}
+
+
+/**
+ * vnc_base_framebuffer_frame_complete:
+ * @fb: (transfer none): the framebuffer object
+ *
+ * Inform the framebuffer that a complete framebuffer update
+ * has been drawn into it, so its contents are consistent.
+ * Subclasses which present the framebuffer from a separate
+ * buffer can use this to decide when to swap buffers. It is
+ * a no-op for the base class
+ */
+void vnc_base_framebuffer_frame_complete(VncBaseFramebuffer *fb)
+{
+    VncBaseFramebufferClass *klass = VNC_BASE_FRAMEBUFFER_GET_CLASS(fb);
+
+    if (klass->frame_complete)
+        klass->frame_complete(fb);
+}
+
+
 static guint16 vnc_base_framebuffer_get_width(VncFramebuffer *iface)
 {
     VncBaseFramebuffer *fb = VNC_BASE_FRAMEBUFFER(iface);
@@ -900,6 +989,44 @@ static void vnc_base_framebuffer_reinit_render_funcs(VncBaseFramebuffer *fb)
 }
 
 
+/*
+ * Record that the area has been drawn to, by marking every
+ * tile it touches. Callable from whichever thread is doing
+ * the drawing, concurrently with the damage being fetched
+ */
+static void vnc_base_framebuffer_damage(VncBaseFramebuffer *fb,
+                                        guint16 x, guint16 y,
+                                        guint16 width, guint16 height)
+{
+    VncBaseFramebufferPrivate *priv = fb->priv;
+    guint tx, ty, tx1, ty1;
+
+    if (!width || !height ||
+        x >= priv->width || y >= priv->height)
+        return;
+
+    g_mutex_lock(priv->damageLock);
+
+    if (!priv->damage) {
+        priv->damageCols = (priv->width + VNC_BASE_FRAMEBUFFER_DAMAGE_TILE - 1) /
+            VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+        priv->damageRows = (priv->height + VNC_BASE_FRAMEBUFFER_DAMAGE_TILE - 1) /
+            VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+        priv->damage = g_new0(guint8, priv->damageCols * priv->damageRows);
+    }
+
+    tx1 = MIN(x + width - 1, priv->width - 1) / VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+    ty1 = MIN(y + height - 1, priv->height - 1) / VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+
+    for (ty = y / VNC_BASE_FRAMEBUFFER_DAMAGE_TILE; ty <= ty1; ty++)
+        for (tx = x / VNC_BASE_FRAMEBUFFER_DAMAGE_TILE; tx <= tx1; tx++)
+            priv->damage[(ty * priv->damageCols) + tx] = 1;
+    priv->damaged = TRUE;
+
+    g_mutex_unlock(priv->damageLock);
+}
+
+
 static void vnc_base_framebuffer_set_pixel_at(VncFramebuffer *iface,
                                               guint8 *src,
                                               guint16 x, guint16 y)
@@ -910,6 +1037,7 @@ static void vnc_base_framebuffer_set_pixel_at(VncFramebuffer *iface,
     vnc_base_framebuffer_reinit_render_funcs(fb);
 
     priv->set_pixel_at(priv, src, x, y);
+    vnc_base_framebuffer_damage(fb, x, y, 1, 1);
 }
 
 
@@ -924,6 +1052,7 @@ static void vnc_base_framebuffer_fill(VncFramebuffer *iface,
     vnc_base_framebuffer_reinit_render_funcs(fb);
 
     priv->fill(priv, src, x, y, width, height);
+    vnc_base_framebuffer_damage(fb, x, y, width, height);
 }
 
 
@@ -953,6 +1082,10 @@ static void vnc_base_framebuffer_copyrect(VncFramebuffer *iface,
         dst += rowstride;
         src += rowstride;
     }
+
+    if (rowstride < 0)
+        dsty -= (height - 1);
+    vnc_base_framebuffer_damage(fb, dstx, dsty, width, height);
 }
 
 
@@ -968,6 +1101,7 @@ static void vnc_base_framebuffer_blt(VncFramebuffer *iface,
     vnc_base_framebuffer_reinit_render_funcs(fb);
 
     priv->blt(priv, src, rowstride, x, y, width, height);
+    vnc_base_framebuffer_damage(fb, x, y, width, height);
 }
 
 
@@ -982,10 +1116,12 @@ static void vnc_base_framebuffer_rgb24_blt(VncFramebuffer *iface,
 
     vnc_base_framebuffer_reinit_render_funcs(fb);
 
-    if (priv->rgb24_blt)
+    if (priv->rgb24_blt) {
         priv->rgb24_blt(priv, src, rowstride, x, y, width, height);
-    else
+        vnc_base_framebuffer_damage(fb, x, y, width, height);
+    } else {
         VNC_DEBUG("Unexpected RGB blt request in colourmap mode");
+    }
 }
 
 
@@ -37,6 +37,9 @@ G_BEGIN_DECLS
 #define VNC_BASE_FRAMEBUFFER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), VNC_TYPE_BASE_FRAMEBUFFER, VncBaseFramebufferClass))
 
 
+/* Size in pixels of the square tiles used to record damage */
+#define VNC_BASE_FRAMEBUFFER_DAMAGE_TILE 64
+
 typedef struct _VncBaseFramebuffer VncBaseFramebuffer;
 typedef struct _VncBaseFramebufferPrivate VncBaseFramebufferPrivate;
 typedef struct _VncBaseFramebufferClass VncBaseFramebufferClass;
@@ -54,11 +57,13 @@ struct _VncBaseFramebufferClass
 {
     GObjectClass parent_class;
 
+    void (*frame_complete)(VncBaseFramebuffer *fb);
+
     /*
      * If adding fields to this struct, remove corresponding
      * amount of padding to avoid changing overall struct size
      */
-    gpointer _vnc_reserved[VNC_PADDING];
+    gpointer _vnc_reserved[VNC_PADDING - 1];
 };
 
 
@@ -71,6 +76,12 @@ VncBaseFramebuffer *vnc_base_framebuffer_new(guint8 *buffer,
                                              const VncPixelFormat *localFormat,
                                              const VncPixelFormat *remoteFormat);
 
+gboolean vnc_base_framebuffer_fetch_damage(VncBaseFramebuffer *fb,
+                                           guint8 **tiles,
+                                           guint *cols,
+                                           guint *rows);
+
+void vnc_base_framebuffer_frame_complete(VncBaseFramebuffer *fb);
 
 
 G_END_DECLS
@@ -27,11 +27,27 @@
 #include "vnccairoframebuffer.h"
 #include "vncutil.h"
 
+#if GLIB_CHECK_VERSION(2, 31, 0)
+#define g_mutex_new() g_new0(GMutex, 1)
+#define g_mutex_free(m) g_free(m)
+#endif
+
 #define VNC_CAIRO_FRAMEBUFFER_GET_PRIVATE(obj)                          \
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), VNC_TYPE_CAIRO_FRAMEBUFFER, VncCairoFramebufferPrivate))
 
 struct _VncCairoFramebufferPrivate {
     cairo_surface_t *surface;
+
+    /* In buffered mode 'surface' is the front buffer being
+     * presented, 'back' the one being drawn into, and 'spare'
+     * (when triple buffered) the latest complete frame which
+     * has not yet been presented */
+    int buffers;
+    cairo_surface_t *back;
+    cairo_surface_t *spare;
+    GMutex *lock;
+    guint8 *ready; /* Tiles changed since the last present */
+    gboolean readyDamaged;
 };
 
 
@@ -87,14 +103,110 @@ static void vnc_cairo_framebuffer_finalize (GObject *object)
 
     if (priv->surface)
         cairo_surface_destroy(priv->surface);
+    if (priv->back)
+        cairo_surface_destroy(priv->back);
+    if (priv->spare)
+        cairo_surface_destroy(priv->spare);
+    if (priv->lock)
+        g_mutex_free(priv->lock);
+    g_free(priv->ready);
 
     G_OBJECT_CLASS(vnc_cairo_framebuffer_parent_class)->finalize (object);
 }
 
+/*
+ * Copy the tiles marked in 'tiles' from one surface to
+ * another, merging horizontally adjacent tiles into a
+ * single run per scanline
+ */
+static void vnc_cairo_framebuffer_copy_tiles(cairo_surface_t *dst,
+                                             cairo_surface_t *src,
+                                             const guint8 *tiles,
+                                             guint cols, guint rows)
+{
+    int width = cairo_image_surface_get_width(src);
+    int height = cairo_image_surface_get_height(src);
+    int stride = cairo_image_surface_get_stride(src);
+    guint8 *sdata, *ddata;
+    guint tx, ty;
+
+    cairo_surface_flush(src);
+    cairo_surface_flush(dst);
+    sdata = cairo_image_surface_get_data(src);
+    ddata = cairo_image_surface_get_data(dst);
+
+    for (ty = 0; ty < rows; ty++) {
+        int y0 = ty * VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+        int y1 = MIN(y0 + VNC_BASE_FRAMEBUFFER_DAMAGE_TILE, height);
+
+        for (tx = 0; tx < cols; tx++) {
+            guint end = tx;
+            int x0, x1, y;
+
+            if (!tiles[(ty * cols) + tx])
+                continue;
+
+            while ((end + 1) < cols && tiles[(ty * cols) + end + 1])
+                end++;
+
+            x0 = tx * VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+            x1 = MIN((end + 1) * VNC_BASE_FRAMEBUFFER_DAMAGE_TILE, width);
+            for (y = y0; y < y1; y++)
+                memcpy(ddata + (y * stride) + (x0 * 4),
+                       sdata + (y * stride) + (x0 * 4),
+                       (x1 - x0) * 4);
+            cairo_surface_mark_dirty_rectangle(dst, x0, y0, x1 - x0, y1 - y0);
+
+            tx = end;
+        }
+    }
+}
+
+
+/*
+ * Called at the end of each framebuffer update, from whichever
+ * thread is decoding. Copies forward only the tiles drawn in
+ * this update, to the front buffer when double buffered, or
+ * to the spare buffer waiting to be presented when triple
+ * buffered
+ */
+static void vnc_cairo_framebuffer_frame_complete(VncBaseFramebuffer *base)
+{
+    VncCairoFramebuffer *fb = VNC_CAIRO_FRAMEBUFFER(base);
+    VncCairoFramebufferPrivate *priv = fb->priv;
+    guint8 *tiles;
+    guint cols, rows, i;
+
+    if (priv->buffers < 2)
+        return;
+
+    if (!vnc_base_framebuffer_fetch_damage(base, &tiles, &cols, &rows))
+        return;
+
+    g_mutex_lock(priv->lock);
+
+    vnc_cairo_framebuffer_copy_tiles(priv->buffers == 3 ?
+                                     priv->spare : priv->surface,
+                                     priv->back, tiles, cols, rows);
+
+    if (!priv->ready)
+        priv->ready = g_new0(guint8, cols * rows);
+    for (i = 0; i < cols * rows; i++)
+        priv->ready[i] |= tiles[i];
+    priv->readyDamaged = TRUE;
+
+    g_mutex_unlock(priv->lock);
+
+    g_free(tiles);
+}
+
+
 static void vnc_cairo_framebuffer_class_init(VncCairoFramebufferClass *klass)
 {
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    VncBaseFramebufferClass *base_class = VNC_BASE_FRAMEBUFFER_CLASS (klass);
 
+    base_class->frame_complete = vnc_cairo_framebuffer_frame_complete;
     object_class->finalize = vnc_cairo_framebuffer_finalize;
     object_class->get_property = vnc_cairo_framebuffer_get_property;
     object_class->set_property = vnc_cairo_framebuffer_set_property;
@@ -140,10 +252,60 @@ void vnc_cairo_framebuffer_init(VncCairoFramebuffer *fb)
 VncCairoFramebuffer *vnc_cairo_framebuffer_new(guint16 width, guint16 height,
                                                const VncPixelFormat *remoteFormat)
 {
-    VncPixelFormat localFormat;
+    return vnc_cairo_framebuffer_new_buffered(width, height, remoteFormat, 1);
+}
+
+
+static cairo_surface_t *vnc_cairo_framebuffer_new_surface(guint16 width, guint16 height)
+{
     cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+
+    memset(cairo_image_surface_get_data(surface), 0,
+           cairo_image_surface_get_stride(surface) * height);
+    cairo_surface_mark_dirty(surface);
+
+    return surface;
+}
+
+
+/**
+ * vnc_cairo_framebuffer_new_buffered:
+ * @width: the remote desktop width
+ * @height: the remote desktop height
+ * @remoteFormat: (transfer none): the remote pixel format
+ * @buffers: the number of buffers, 1, 2 or 3
+ *
+ * Allocate a new framebuffer object which renders the remote
+ * desktop into a back buffer, separate from the cairo image
+ * surface returned by vnc_cairo_framebuffer_get_surface. At
+ * the end of each framebuffer update only the areas which
+ * changed are copied forward, so the surface always holds a
+ * complete frame and decoding may run on a different thread
+ * to the one drawing the surface.
+ *
+ * With 2 buffers the changes are copied straight into the
+ * surface, so it must only be read while holding the lock
+ * from vnc_cairo_framebuffer_lock. With 3 buffers completed
+ * frames are queued in a spare buffer, and only become
+ * visible in the surface after vnc_cairo_framebuffer_present
+ * is called by the thread drawing it, so decoding never waits
+ * for drawing. With 1 buffer this is equivalent to
+ * vnc_cairo_framebuffer_new.
+ *
+ * Returns: (transfer full): the new frame buffer object
+ */
+VncCairoFramebuffer *vnc_cairo_framebuffer_new_buffered(guint16 width, guint16 height,
+                                                        const VncPixelFormat *remoteFormat,
+                                                        int buffers)
+{
+    VncCairoFramebuffer *fb;
+    VncCairoFramebufferPrivate *priv;
+    VncPixelFormat localFormat;
+    cairo_surface_t *surface, *back;
     guint8 *pixels;
 
+    g_return_val_if_fail(buffers >= 1 && buffers <= 3, NULL);
+
     VNC_DEBUG("Surface %dx%d", width, height);
 
     localFormat.red_max = 255;
@@ -156,19 +318,31 @@ VncCairoFramebuffer *vnc_cairo_framebuffer_new(guint16 width, guint16 height,
     localFormat.bits_per_pixel = 32;
     localFormat.byte_order = G_BYTE_ORDER;
 
-    pixels = cairo_image_surface_get_data(surface);
-
-    memset(pixels, 0, width * height * 4);
+    surface = back = vnc_cairo_framebuffer_new_surface(width, height);
+    if (buffers > 1)
+        back = vnc_cairo_framebuffer_new_surface(width, height);
+    pixels = cairo_image_surface_get_data(back);
+
+    fb = VNC_CAIRO_FRAMEBUFFER(g_object_new(VNC_TYPE_CAIRO_FRAMEBUFFER,
+                                            "surface", surface,
+                                            "buffer", pixels,
+                                            "width", width,
+                                            "height", height,
+                                            "rowstride", cairo_image_surface_get_stride(back),
+                                            "local-format", &localFormat,
+                                            "remote-format", remoteFormat,
+                                            NULL));
+    priv = fb->priv;
+
+    priv->buffers = buffers;
+    if (buffers > 1) {
+        priv->back = back;
+        priv->lock = g_mutex_new();
+    }
+    if (buffers > 2)
+        priv->spare = vnc_cairo_framebuffer_new_surface(width, height);
 
-    return VNC_CAIRO_FRAMEBUFFER(g_object_new(VNC_TYPE_CAIRO_FRAMEBUFFER,
-                                              "surface", surface,
-                                              "buffer", pixels,
-                                              "width", width,
-                                              "height", height,
-                                              "rowstride", cairo_image_surface_get_stride(surface),
-                                              "local-format", &localFormat,
-                                              "remote-format", remoteFormat,
-                                              NULL));
+    return fb;
 }
 
 
@@ -189,6 +363,111 @@ cairo_surface_t *vnc_cairo_framebuffer_get_surface(VncCairoFramebuffer *fb)
 }
 
 
+/**
+ * vnc_cairo_framebuffer_lock:
+ * @fb: the framebuffer object
+ *
+ * Prevent the surface from being updated by the decoder
+ * until vnc_cairo_framebuffer_unlock is called. This is
+ * only required for double buffered framebuffers, and is
+ * a no-op otherwise.
+ */
+void vnc_cairo_framebuffer_lock(VncCairoFramebuffer *fb)
+{
+    VncCairoFramebufferPrivate *priv = fb->priv;
+
+    if (priv->buffers == 2)
+        g_mutex_lock(priv->lock);
+}
+
+
+/**
+ * vnc_cairo_framebuffer_unlock:
+ * @fb: the framebuffer object
+ *
+ * Release the lock taken by vnc_cairo_framebuffer_lock
+ */
+void vnc_cairo_framebuffer_unlock(VncCairoFramebuffer *fb)
+{
+    VncCairoFramebufferPrivate *priv = fb->priv;
+
+    if (priv->buffers == 2)
+        g_mutex_unlock(priv->lock);
+}
+
+
+/**
+ * vnc_cairo_framebuffer_present:
+ * @fb: the framebuffer object
+ * @tiles: (out) (transfer full) (array) (allow-none): filled with the damage map
+ * @cols: (out) (allow-none): filled with the number of tile columns
+ * @rows: (out) (allow-none): filled with the number of tile rows
+ *
+ * Make the most recently completed frame visible in the
+ * surface, if it is not already, and report which tiles
+ * of the surface have changed since the previous call,
+ * in the same form as vnc_base_framebuffer_fetch_damage.
+ * For triple buffered framebuffers this swaps the spare
+ * buffer with the surface, so must be called from the
+ * thread drawing the surface, outside of any drawing.
+ *
+ * Returns: TRUE if the surface has changed
+ */
+gboolean vnc_cairo_framebuffer_present(VncCairoFramebuffer *fb,
+                                       guint8 **tiles,
+                                       guint *cols,
+                                       guint *rows)
+{
+    VncCairoFramebufferPrivate *priv = fb->priv;
+    guint tcols, trows;
+    gboolean damaged;
+
+    if (priv->buffers < 2)
+        return vnc_base_framebuffer_fetch_damage(VNC_BASE_FRAMEBUFFER(fb),
+                                                 tiles, cols, rows);
+
+    tcols = (vnc_framebuffer_get_width(VNC_FRAMEBUFFER(fb)) +
+             VNC_BASE_FRAMEBUFFER_DAMAGE_TILE - 1) / VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+    trows = (vnc_framebuffer_get_height(VNC_FRAMEBUFFER(fb)) +
+             VNC_BASE_FRAMEBUFFER_DAMAGE_TILE - 1) / VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+    if (cols)
+        *cols = tcols;
+    if (rows)
+        *rows = trows;
+    if (tiles)
+        *tiles = NULL;
+
+    g_mutex_lock(priv->lock);
+
+    damaged = priv->readyDamaged;
+    if (damaged) {
+        if (priv->buffers == 3) {
+            cairo_surface_t *tmp = priv->surface;
+
+            priv->surface = priv->spare;
+            priv->spare = tmp;
+
+            /* The old front buffer is now the spare, and is
+             * missing the tiles which were just presented */
+            vnc_cairo_framebuffer_copy_tiles(priv->spare, priv->surface,
+                                             priv->ready, tcols, trows);
+        }
+
+        if (tiles) {
+            *tiles = priv->ready;
+            priv->ready = NULL;
+        } else {
+            memset(priv->ready, 0, tcols * trows);
+        }
+        priv->readyDamaged = FALSE;
+    }
+
+    g_mutex_unlock(priv->lock);
+
+    return damaged;
+}
+
+
 /*
  * Local variables:
  *  c-indent-level: 4
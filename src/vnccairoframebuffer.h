@@ -67,8 +67,19 @@ GType vnc_cairo_framebuffer_get_type(void) G_GNUC_CONST;
 VncCairoFramebuffer *vnc_cairo_framebuffer_new(guint16 width, guint16 height,
                                                const VncPixelFormat *remoteFormat);
 
+VncCairoFramebuffer *vnc_cairo_framebuffer_new_buffered(guint16 width, guint16 height,
+                                                        const VncPixelFormat *remoteFormat,
+                                                        int buffers);
+
 cairo_surface_t *vnc_cairo_framebuffer_get_surface(VncCairoFramebuffer *fb);
 
+void vnc_cairo_framebuffer_lock(VncCairoFramebuffer *fb);
+void vnc_cairo_framebuffer_unlock(VncCairoFramebuffer *fb);
+gboolean vnc_cairo_framebuffer_present(VncCairoFramebuffer *fb,
+                                       guint8 **tiles,
+                                       guint *cols,
+                                       guint *rows);
+
 
 G_END_DECLS
 
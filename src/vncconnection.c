@@ -19,10 +19,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#define _GNU_SOURCE
+
 #include <config.h>
 
 #include "vncconnection.h"
 #include "vncconnectionenums.h"
+#include "vncbaseframebuffer.h"
 #include "vncmarshal.h"
 #include "vncutil.h"
 
@@ -52,6 +55,11 @@
 #include <pwd.h>
 #endif
 
+#ifdef HAVE_GIOUNIX
+#include <gio/gunixfdmessage.h>
+#include <sys/mman.h>
+#endif
+
 #include <zlib.h>
 
 #include "dh.h"
@@ -59,8 +67,19 @@
 #if GLIB_CHECK_VERSION(2, 31, 0)
 #define g_mutex_new() g_new0(GMutex, 1)
 #define g_mutex_free(m) g_free(m)
+#define g_cond_new() g_new0(GCond, 1)
+#define g_cond_free(c) g_free(c)
 #endif
 
+/* Upper bound on data pulled off the wire by the receive
+ * thread which the coroutine has yet to consume */
+#define VNC_CONNECTION_RECV_QUEUE_SIZE (1024 * 1024)
+#define VNC_CONNECTION_RECV_CHUNK_SIZE (64 * 1024)
+
+/* Largest the decoder scratch arena is kept at, so one huge
+ * rect can't pin its memory for the rest of the connection */
+#define VNC_CONNECTION_SCRATCH_MAX (4 * 1024 * 1024)
+
 /*
  * When GNUTLS >= 2.12, we must not initialize gcrypt threading
  * because GNUTLS will do that itself, *provided* it is built
@@ -109,6 +128,56 @@ struct wait_queue
     struct coroutine *context;
 };
 
+typedef enum {
+    VNC_CONNECTION_DECODE_COMMIT_BLT,
+    VNC_CONNECTION_DECODE_COMMIT_FILL,
+    VNC_CONNECTION_DECODE_COMMIT_RGB24,
+} VncConnectionDecodeCommit;
+
+/*
+ * A rect whose pixel decoding is done off the VNC coroutine.
+ * Jobs are committed to the framebuffer strictly in the order
+ * they were queued, once 'done' is set by the worker
+ */
+struct decode_job
+{
+    VncConnection *conn;
+    VncConnectionDecodeCommit commit;
+    guint16 x, y, width, height;
+
+    gboolean done;
+    gboolean failed;
+    const char *error;
+    int pending;
+
+    guint8 fill[4];
+    guint8 *pixels;
+    int rowstride;
+    GdkPixbuf *pixbuf;
+
+    /* Tight basic compression */
+    int stream;
+    guint8 filter_id;
+    int palette_size;
+    guint8 palette[256][4];
+    guint8 *zlib_data;
+    size_t zlib_length;
+    guint8 *data;
+    size_t data_size;
+
+    /* ZRLE, rendered one band of tiles per task */
+    size_t *tile_offsets;
+    struct decode_band *bands;
+};
+
+struct decode_band
+{
+    struct decode_job *job;
+    guint16 y;
+    guint16 height;
+    size_t *tile_offsets;
+};
+
 typedef enum {
     VNC_CONNECTION_SERVER_MESSAGE_FRAMEBUFFER_UPDATE = 0,
     VNC_CONNECTION_SERVER_MESSAGE_SET_COLOR_MAP_ENTRIES = 1,
@@ -159,9 +228,13 @@ typedef void vnc_connection_tight_compute_predicted_func(VncConnection *conn, gu
 
 typedef void vnc_connection_tight_sum_pixel_func(VncConnection *conn, guint8 *, guint8 *);
 static void vnc_connection_close(VncConnection *conn);
+static void vnc_connection_decode_flush(VncConnection *conn);
 static void vnc_connection_set_error(VncConnection *conn,
                                      const char *format,
                                      ...) G_GNUC_PRINTF(2, 3);
+#ifdef HAVE_GIOUNIX
+static void vnc_connection_shm_release(VncConnection *conn);
+#endif
 
 /*
  * A special GSource impl which allows us to wait on a certain
@@ -189,6 +262,7 @@ struct g_condition_wait_source
 struct _VncConnectionPrivate
 {
     struct coroutine coroutine;
+    gsize coroutine_stack_size;
     guint open_id;
     GSocket *sock;
     GSocketAddress *addr;
@@ -230,6 +304,45 @@ struct _VncConnectionPrivate
     size_t read_offset;
     size_t read_size;
 
+    gboolean recv_threaded;
+    GThread *recv_thread;
+    GMutex *recv_lock;
+    GCond *recv_cond;
+    GCancellable *recv_cancel;
+    guint8 *recv_queue;
+    size_t recv_queue_offset;
+    size_t recv_queue_size;
+    int recv_queue_error;
+    const char *recv_queue_message;
+    gboolean recv_quit;
+#ifdef HAVE_SASL
+    GMutex *sasl_lock;
+#endif
+
+    int decode_threads;
+    GMutex *decode_lock;
+    GQueue decode_pending;
+    GThreadPool *tight_pool[4];
+    GThreadPool *zrle_pool;
+    GThreadPool *jpeg_pool;
+
+    guint8 *scratch;
+    gsize scratch_size;
+    gsize scratch_used;
+    gsize scratch_wanted;
+    gsize scratch_peak;
+    VncColorMap *color_map;
+
+#ifdef HAVE_GIOUNIX
+    gboolean shm_requested;
+    GMutex *shm_lock;
+    GQueue shm_fds; /* Received file descriptors not yet claimed */
+    guint8 *shm_map;
+    gsize shm_map_size;
+    guint8 *shm_pixels;
+    guint32 shm_stride;
+#endif
+
     char write_buffer[4096];
     size_t write_offset;
 
@@ -261,8 +374,6 @@ struct _VncConnectionPrivate
     size_t compressed_length;
     guint8 *compressed_buffer;
 
-    guint8 zrle_pi;
-    int zrle_pi_bits;
 
     int ledstate;
     gboolean has_ext_key_event;
@@ -283,6 +394,10 @@ struct _VncConnectionPrivate
     VncAudio *audio;
     VncAudioSample *audio_sample;
     guint audio_timer;
+
+    /* Pushed by the coroutine, newest first, and taken
+     * all at once by the main context */
+    struct signal_event *events;
 };
 
 G_DEFINE_TYPE(VncConnection, vnc_connection, G_TYPE_OBJECT);
@@ -447,10 +562,50 @@ static gboolean g_condition_wait(g_condition_wait_func func, gpointer data)
     return TRUE;
 }
 
+/*
+ * As g_condition_wait, but a call to g_io_wakeup on @wait
+ * will abort the wait, in which case FALSE is returned
+ */
+static gboolean g_condition_wait_interruptable(struct wait_queue *wait,
+                                               g_condition_wait_func func,
+                                               gpointer data)
+{
+    GSource *src;
+    struct g_condition_wait_source *vsrc;
+    gboolean ret;
+
+    if (func(data)) {
+        return TRUE;
+    }
+
+    src = g_source_new(&waitFuncs, sizeof(struct g_condition_wait_source));
+    vsrc = (struct g_condition_wait_source *)src;
+
+    vsrc->func = func;
+    vsrc->data = data;
+    vsrc->co = coroutine_self();
+
+    wait->context = coroutine_self();
+    g_source_attach(src, NULL);
+    g_source_set_callback(src, g_condition_wait_helper, wait->context, NULL);
+    wait->waiting = TRUE;
+    coroutine_yield(NULL);
+    wait->waiting = FALSE;
+
+    /* Both the source dispatch & g_io_wakeup resume us
+     * with NULL, so re-check to tell them apart */
+    ret = func(data);
+    g_source_destroy(src);
+    g_source_unref(src);
+
+    return ret;
+}
+
 
 enum {
     PROP_0,
     PROP_FRAMEBUFFER,
+    PROP_SCRATCH_PEAK,
 };
 
 
@@ -467,6 +622,10 @@ static void vnc_connection_get_property(GObject *object,
         g_value_set_object(value, priv->fb);
         break;
 
+    case PROP_SCRATCH_PEAK:
+        g_value_set_uint64(value, priv->scratch_peak);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -520,10 +679,34 @@ struct signal_data
     } params;
 };
 
-static gboolean do_vnc_connection_emit_main_context(gpointer opaque)
+enum {
+    VNC_AUDIO_PLAYBACK_STOP = 0,
+    VNC_AUDIO_PLAYBACK_START = 1,
+    VNC_AUDIO_PLAYBACK_DATA = 2,
+};
+
+/*
+ * A signal, or audio action, handed to the main context
+ * without the coroutine waiting for it to be dispatched.
+ * The event holds its own copy or reference of anything
+ * the coroutine might free or replace meanwhile
+ */
+struct signal_event
 {
-    struct signal_data *data = opaque;
+    struct signal_event *next;
+
+    gboolean audio;
+    struct signal_data data;
+    gchar *text;
+    VncCursor *cursor;
+
+    int action;
+    VncAudioFormat format;
+    VncAudioSample *sample;
+};
 
+static void vnc_connection_emit_signal(struct signal_data *data)
+{
     VNC_DEBUG("Emit main context %d", data->signum);
     switch (data->signum) {
     case VNC_CURSOR_CHANGED:
@@ -639,12 +822,158 @@ static gboolean do_vnc_connection_emit_main_context(gpointer opaque)
     default:
         g_warn_if_reached();
     }
+}
+
+static void vnc_connection_signal_event_free(struct signal_event *ev)
+{
+    g_free(ev->text);
+    if (ev->cursor)
+        g_object_unref(ev->cursor);
+    if (ev->sample)
+        vnc_audio_sample_free(ev->sample);
+    g_free(ev);
+}
+
+static void vnc_connection_audio_event(VncConnection *conn,
+                                       struct signal_event *ev)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    VNC_DEBUG("Audio action main context %u", ev->action);
+
+    if (!priv->audio)
+        return;
+
+    switch (ev->action) {
+    case VNC_AUDIO_PLAYBACK_STOP:
+        vnc_audio_playback_stop(priv->audio);
+        break;
+    case VNC_AUDIO_PLAYBACK_START:
+        vnc_audio_playback_start(priv->audio, &ev->format);
+        break;
+    case VNC_AUDIO_PLAYBACK_DATA:
+        vnc_audio_playback_data(priv->audio, ev->sample);
+        break;
+    default:
+        g_warn_if_reached();
+    }
+}
+
+/*
+ * Dispatch all the events queued so far, oldest first
+ *
+ * Must only be called from the SYSTEM coroutine
+ */
+static void vnc_connection_dispatch_events(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    struct signal_event *list, *ev, *ordered = NULL;
+
+    /* Only ever taken whole, so the head can't be
+     * popped and pushed again behind our back */
+    do {
+        list = g_atomic_pointer_get(&priv->events);
+    } while (list &&
+             !g_atomic_pointer_compare_and_exchange(&priv->events, list, NULL));
+
+    while (list) {
+        ev = list;
+        list = ev->next;
+        ev->next = ordered;
+        ordered = ev;
+    }
+
+    while (ordered) {
+        ev = ordered;
+        ordered = ev->next;
+
+        if (ev->audio)
+            vnc_connection_audio_event(conn, ev);
+        else
+            vnc_connection_emit_signal(&ev->data);
+        vnc_connection_signal_event_free(ev);
+    }
+}
+
+static gboolean do_vnc_connection_dispatch_events(gpointer opaque)
+{
+    VncConnection *conn = opaque;
+
+    vnc_connection_dispatch_events(conn);
+    g_object_unref(conn);
+
+    return FALSE;
+}
+
+/*
+ * Push an event without taking any lock. Only the first
+ * event into an empty queue schedules a dispatch, which
+ * then delivers every event queued before it runs
+ */
+static void vnc_connection_queue_event(VncConnection *conn,
+                                       struct signal_event *ev)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    struct signal_event *head;
+
+    do {
+        head = g_atomic_pointer_get(&priv->events);
+        ev->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&priv->events, head, ev));
+
+    if (head == NULL)
+        g_idle_add(do_vnc_connection_dispatch_events, g_object_ref(conn));
+}
+
+/*
+ * Emit a signal which needs no reply, without waiting
+ * for the main context to handle it
+ */
+static void vnc_connection_emit_async(VncConnection *conn,
+                                      int signum,
+                                      struct signal_data *data)
+{
+    struct signal_event *ev = g_new0(struct signal_event, 1);
+
+    ev->data = *data;
+    ev->data.conn = conn;
+    ev->data.caller = NULL;
+    ev->data.signum = signum;
+
+    switch (signum) {
+    case VNC_SERVER_CUT_TEXT:
+        ev->text = g_strdup(data->params.text);
+        ev->data.params.text = ev->text;
+        break;
+    case VNC_CURSOR_CHANGED:
+        if (data->params.cursor)
+            ev->cursor = g_object_ref(data->params.cursor);
+        break;
+    default:
+        break;
+    }
+
+    vnc_connection_queue_event(conn, ev);
+}
+
+static gboolean do_vnc_connection_emit_main_context(gpointer opaque)
+{
+    struct signal_data *data = opaque;
+
+    /* Anything queued was raised first, so goes first */
+    vnc_connection_dispatch_events(data->conn);
+    vnc_connection_emit_signal(data);
 
     coroutine_yieldto(data->caller, NULL);
 
     return FALSE;
 }
 
+/*
+ * Emit a signal and wait for it to be handled, for those
+ * whose handlers reply, or which change the state the
+ * coroutine carries on with
+ */
 static void vnc_connection_emit_main_context(VncConnection *conn,
                                              int signum,
                                              struct signal_data *data)
@@ -739,6 +1068,67 @@ static int vnc_connection_zread(VncConnection *conn, void *buffer, size_t size)
 
 /* IO functions */
 
+#ifdef HAVE_GIOUNIX
+/*
+ * Receive off a UNIX socket, collecting any file descriptors
+ * the server passed along with the data. They are queued in
+ * arrival order, to be claimed by the shared memory messages
+ * they belong to once the coroutine gets to those
+ */
+static gssize vnc_connection_receive_fds(VncConnection *conn,
+                                         void *data, size_t len,
+                                         GCancellable *cancel,
+                                         GError **error)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    GInputVector vec = { data, len };
+    GSocketControlMessage **messages = NULL;
+    gint nmessages = 0;
+    gint flags = 0;
+    gssize ret;
+    gint i;
+
+    ret = g_socket_receive_message(priv->sock, NULL, &vec, 1,
+                                   &messages, &nmessages, &flags,
+                                   cancel, error);
+
+    for (i = 0; i < nmessages; i++) {
+        if (G_IS_UNIX_FD_MESSAGE(messages[i])) {
+            gint *fds;
+            gint nfds, j;
+
+            fds = g_unix_fd_message_steal_fds(G_UNIX_FD_MESSAGE(messages[i]),
+                                              &nfds);
+            g_mutex_lock(priv->shm_lock);
+            for (j = 0; j < nfds; j++)
+                g_queue_push_tail(&priv->shm_fds, GINT_TO_POINTER(fds[j]));
+            g_mutex_unlock(priv->shm_lock);
+            g_free(fds);
+        }
+        g_object_unref(messages[i]);
+    }
+    g_free(messages);
+
+    return ret;
+}
+#endif
+
+
+static gssize vnc_connection_receive(VncConnection *conn,
+                                     void *data, size_t len,
+                                     GCancellable *cancel,
+                                     GError **error)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+#ifdef HAVE_GIOUNIX
+    if (priv->shm_requested)
+        return vnc_connection_receive_fds(conn, data, len, cancel, error);
+#endif
+
+    return g_socket_receive(priv->sock, data, len, cancel, error);
+}
+
 
 /*
  * Read at least 1 more byte of data straight off the wire
@@ -763,9 +1153,9 @@ static int vnc_connection_read_wire(VncConnection *conn, void *data, size_t len)
         }
     } else {
         GError *error = NULL;
-        ret = g_socket_receive(priv->sock,
-                               data, len,
-                               NULL, &error);
+        ret = vnc_connection_receive(conn,
+                                     data, len,
+                                     NULL, &error);
         if (ret < 0) {
             if (error) {
                 VNC_DEBUG("Read error %s", error->message);
@@ -875,115 +1265,558 @@ static int vnc_connection_read_plain(VncConnection *conn)
     return vnc_connection_read_wire(conn, priv->read_buffer, sizeof(priv->read_buffer));
 }
 
+
 /*
- * Read at least 1 more byte of data into the internal read_buffer
+ * The optional receive thread drains the socket (doing any
+ * TLS / SASL decryption along the way) into a bounded queue,
+ * so the server can keep streaming while the coroutine is
+ * busy decoding a large update. The coroutine then refills
+ * its read_buffer from the queue instead of the wire.
  */
-static int vnc_connection_read_buf(VncConnection *conn)
+static void vnc_connection_threads_init(void)
 {
-#ifdef HAVE_SASL
-    VncConnectionPrivate *priv = conn->priv;
-
-    if (priv->saslconn)
-        return vnc_connection_read_sasl(conn);
-    else
+#if !GLIB_CHECK_VERSION(2, 31, 0)
+    if (!g_thread_supported())
+        g_thread_init(NULL);
 #endif
-        return vnc_connection_read_plain(conn);
 }
 
-/*
- * Fill the 'data' buffer up with exactly 'len' bytes worth of data
- *
- * Must only be called from the VNC coroutine
- */
-static int vnc_connection_read(VncConnection *conn, void *data, size_t len)
+static GThread *vnc_connection_thread_new(const char *name,
+                                          GThreadFunc func,
+                                          gpointer data)
 {
-    VncConnectionPrivate *priv = conn->priv;
-    char *ptr = data;
-    size_t offset = 0;
-
-    if (priv->coroutine_stop) return -EINVAL;
-
-    while (offset < len) {
-        size_t tmp;
-
-        /* compressed data is buffered independently of the read buffer
-         * so we must by-pass it */
-        if (vnc_connection_use_compression(conn)) {
-            int ret = vnc_connection_zread(conn, ptr + offset, len);
-            if (ret == -1) {
-                vnc_connection_set_error(conn, "%s", "Failure decompressing data");
-                return -errno;
-            }
-            offset += ret;
-            continue;
-        } else if (priv->read_offset == priv->read_size) {
-            int ret = vnc_connection_read_buf(conn);
-
-            if (ret < 0)
-                return ret;
-            priv->read_offset = 0;
-            priv->read_size = ret;
-        }
-
-        tmp = MIN(priv->read_size - priv->read_offset, len - offset);
-
-        memcpy(ptr + offset, priv->read_buffer + priv->read_offset, tmp);
-
-        priv->read_offset += tmp;
-        offset += tmp;
-    }
-
-    return 0;
+    vnc_connection_threads_init();
+#if GLIB_CHECK_VERSION(2, 31, 0)
+    return g_thread_new(name, func, data);
+#else
+    (void)name;
+    return g_thread_create(func, data, TRUE, NULL);
+#endif
 }
 
+
 /*
- * Write all 'data' of length 'datalen' bytes out to
- * the wire
+ * Read at least 1 more byte of data straight off the wire,
+ * blocking until some is available
+ *
+ * Must only be called from the receive thread
  */
-static void vnc_connection_flush_wire(VncConnection *conn,
-                                      const void *data,
-                                      size_t datalen)
+static int vnc_connection_recv_wire(VncConnection *conn,
+                                    void *data, size_t len,
+                                    const char **message)
 {
     VncConnectionPrivate *priv = conn->priv;
-    const char *ptr = data;
-    size_t offset = 0;
-    //VNC_DEBUG("Flush write %p %d", data, datalen);
-    while (offset < datalen) {
-        int ret;
+    int ret;
+
+    for (;;) {
         gboolean blocking = FALSE;
+        GError *error = NULL;
 
-        if (priv->coroutine_stop) return;
+        if (g_cancellable_is_cancelled(priv->recv_cancel))
+            return -EINVAL;
 
         if (priv->tls_session) {
-            ret = gnutls_write(priv->tls_session,
-                               ptr+offset,
-                               datalen-offset);
+            ret = gnutls_read(priv->tls_session, data, len);
             if (ret < 0) {
-                if (ret == GNUTLS_E_AGAIN)
+                if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
                     blocking = TRUE;
                 ret = -1;
             }
         } else {
-            GError *error = NULL;
-            ret = g_socket_send(priv->sock,
-                                ptr+offset,
-                                datalen-offset,
-                                NULL, &error);
+            ret = vnc_connection_receive(conn,
+                                         data, len,
+                                         priv->recv_cancel, &error);
             if (ret < 0) {
                 if (error) {
+                    VNC_DEBUG("Read error %s", error->message);
                     if (error->code == G_IO_ERROR_WOULD_BLOCK)
                         blocking = TRUE;
+                    else if (error->code == G_IO_ERROR_CANCELLED)
+                        ret = -2;
                     g_error_free(error);
                 }
-                ret = -1;
-            }
-        }
-        if (ret == -1) {
-            if (blocking) {
-                g_io_wait(priv->sock, G_IO_OUT);
-            } else {
-                vnc_connection_set_error(conn, "%s", "Failed to flush data");
-                return;
+            }
+        }
+
+        if (ret > 0)
+            return ret;
+
+        if (ret == 0) {
+            VNC_DEBUG("Closing the connection: vnc_connection_recv_wire() - ret=0");
+            *message = "Server closed the connection";
+            return -EPIPE;
+        }
+
+        if (!blocking) {
+            if (ret == -1)
+                *message = "Unable to read from server";
+            return -EINVAL;
+        }
+
+        if (!g_socket_condition_wait(priv->sock, G_IO_IN,
+                                     priv->recv_cancel, &error)) {
+            VNC_DEBUG("Receive wait aborted %s",
+                      error ? error->message : "unknown");
+            g_clear_error(&error);
+            return -EINVAL;
+        }
+    }
+}
+
+
+/*
+ * Append 'len' bytes to the receive queue, blocking while
+ * it is full. Returns FALSE if the thread was told to quit
+ *
+ * Must only be called from the receive thread
+ */
+static gboolean vnc_connection_recv_queue_push(VncConnection *conn,
+                                               const guint8 *data,
+                                               size_t len)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    gboolean quit;
+
+    g_mutex_lock(priv->recv_lock);
+    while (len && !priv->recv_quit) {
+        size_t tail, want;
+
+        if (priv->recv_queue_size == VNC_CONNECTION_RECV_QUEUE_SIZE) {
+            g_cond_wait(priv->recv_cond, priv->recv_lock);
+            continue;
+        }
+
+        tail = (priv->recv_queue_offset + priv->recv_queue_size) %
+            VNC_CONNECTION_RECV_QUEUE_SIZE;
+        want = MIN(len, VNC_CONNECTION_RECV_QUEUE_SIZE - priv->recv_queue_size);
+        want = MIN(want, VNC_CONNECTION_RECV_QUEUE_SIZE - tail);
+
+        memcpy(priv->recv_queue + tail, data, want);
+        priv->recv_queue_size += want;
+        data += want;
+        len -= want;
+
+        /* Kick the main loop so the coroutine's condition
+         * wait gets re-checked */
+        g_main_context_wakeup(NULL);
+    }
+    quit = priv->recv_quit;
+    g_mutex_unlock(priv->recv_lock);
+
+    return !quit;
+}
+
+
+static gpointer vnc_connection_recv_thread(gpointer opaque)
+{
+    VncConnection *conn = opaque;
+    VncConnectionPrivate *priv = conn->priv;
+    guint8 *buf = g_new(guint8, VNC_CONNECTION_RECV_CHUNK_SIZE);
+    const char *message = NULL;
+    int ret;
+
+    VNC_DEBUG("Receive thread started");
+
+    for (;;) {
+        const guint8 *data = buf;
+        size_t len;
+
+        ret = vnc_connection_recv_wire(conn, buf,
+                                       VNC_CONNECTION_RECV_CHUNK_SIZE,
+                                       &message);
+        if (ret < 0)
+            break;
+        len = ret;
+
+#ifdef HAVE_SASL
+        if (priv->saslconn) {
+            const char *decoded;
+            unsigned int decodedLen;
+            int err;
+
+            g_mutex_lock(priv->sasl_lock);
+            err = sasl_decode(priv->saslconn, (char *)buf, len,
+                              &decoded, &decodedLen);
+            g_mutex_unlock(priv->sasl_lock);
+            if (err != SASL_OK) {
+                VNC_DEBUG("Failed to decode SASL data %s",
+                          sasl_errstring(err, NULL, NULL));
+                message = "Failed to decode SASL data";
+                ret = -EINVAL;
+                break;
+            }
+            data = (const guint8 *)decoded;
+            len = decodedLen;
+        }
+#endif
+
+        if (!vnc_connection_recv_queue_push(conn, data, len)) {
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+    g_mutex_lock(priv->recv_lock);
+    priv->recv_queue_error = ret;
+    priv->recv_queue_message = message;
+    g_mutex_unlock(priv->recv_lock);
+    g_main_context_wakeup(NULL);
+
+    g_free(buf);
+    VNC_DEBUG("Receive thread exiting %d", ret);
+    return NULL;
+}
+
+
+static gboolean vnc_connection_recv_queue_ready(gpointer opaque)
+{
+    VncConnection *conn = opaque;
+    VncConnectionPrivate *priv = conn->priv;
+    gboolean ready;
+
+    if (priv->coroutine_stop)
+        return TRUE;
+
+    g_mutex_lock(priv->recv_lock);
+    ready = priv->recv_queue_size || priv->recv_queue_error;
+    g_mutex_unlock(priv->recv_lock);
+
+    return ready;
+}
+
+
+/*
+ * Read at least 1 more byte of data out of the receive
+ * queue, into the internal read buffer
+ */
+static int vnc_connection_read_queue(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    for (;;) {
+        int err;
+        const char *message;
+
+        if (priv->coroutine_stop) return -EINVAL;
+
+        g_mutex_lock(priv->recv_lock);
+        if (priv->recv_queue_size) {
+            size_t want = MIN(priv->recv_queue_size, sizeof(priv->read_buffer));
+            want = MIN(want, VNC_CONNECTION_RECV_QUEUE_SIZE - priv->recv_queue_offset);
+
+            memcpy(priv->read_buffer,
+                   priv->recv_queue + priv->recv_queue_offset,
+                   want);
+            priv->recv_queue_offset = (priv->recv_queue_offset + want) %
+                VNC_CONNECTION_RECV_QUEUE_SIZE;
+            priv->recv_queue_size -= want;
+            g_cond_signal(priv->recv_cond);
+            g_mutex_unlock(priv->recv_lock);
+            return want;
+        }
+        err = priv->recv_queue_error;
+        message = priv->recv_queue_message;
+        g_mutex_unlock(priv->recv_lock);
+
+        if (err) {
+            if (message)
+                vnc_connection_set_error(conn, "%s", message);
+            return err;
+        }
+
+        if (priv->wait_interruptable) {
+            if (!g_condition_wait_interruptable(&priv->wait,
+                                                vnc_connection_recv_queue_ready,
+                                                conn))
+                return -EAGAIN;
+        } else {
+            g_condition_wait(vnc_connection_recv_queue_ready, conn);
+        }
+    }
+}
+
+
+/*
+ * Hand over reading the socket to a background thread. Any
+ * data already buffered by the coroutine is consumed first.
+ *
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_recv_start(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+#ifdef HAVE_SASL
+    if (priv->saslDecoded &&
+        (priv->saslDecodedLength - priv->saslDecodedOffset) > VNC_CONNECTION_RECV_QUEUE_SIZE) {
+        VNC_DEBUG("Too much SASL data pending, reading in coroutine");
+        return;
+    }
+#endif
+
+    priv->recv_queue = g_new(guint8, VNC_CONNECTION_RECV_QUEUE_SIZE);
+    priv->recv_queue_offset = priv->recv_queue_size = 0;
+#ifdef HAVE_SASL
+    /* Decoded data not yet read lives in the SASL output
+     * buffer, which the thread's first decode reuses, so
+     * it is queued ahead of anything the thread reads */
+    if (priv->saslDecoded) {
+        priv->recv_queue_size = priv->saslDecodedLength - priv->saslDecodedOffset;
+        memcpy(priv->recv_queue,
+               priv->saslDecoded + priv->saslDecodedOffset,
+               priv->recv_queue_size);
+    }
+#endif
+    priv->recv_queue_error = 0;
+    priv->recv_queue_message = NULL;
+    priv->recv_quit = FALSE;
+    priv->recv_lock = g_mutex_new();
+    priv->recv_cond = g_cond_new();
+    priv->recv_cancel = g_cancellable_new();
+#ifdef HAVE_SASL
+    priv->sasl_lock = g_mutex_new();
+#endif
+
+    priv->recv_thread = vnc_connection_thread_new("vnc-recv",
+                                                  vnc_connection_recv_thread,
+                                                  conn);
+    if (!priv->recv_thread) {
+        VNC_DEBUG("Unable to start receive thread, reading in coroutine");
+        g_object_unref(priv->recv_cancel);
+        priv->recv_cancel = NULL;
+        g_cond_free(priv->recv_cond);
+        priv->recv_cond = NULL;
+        g_mutex_free(priv->recv_lock);
+        priv->recv_lock = NULL;
+#ifdef HAVE_SASL
+        g_mutex_free(priv->sasl_lock);
+        priv->sasl_lock = NULL;
+#endif
+        g_free(priv->recv_queue);
+        priv->recv_queue = NULL;
+        return;
+    }
+
+#ifdef HAVE_SASL
+    priv->saslDecoded = NULL;
+    priv->saslDecodedLength = priv->saslDecodedOffset = 0;
+#endif
+}
+
+
+static void vnc_connection_recv_stop(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    if (!priv->recv_thread)
+        return;
+
+    g_mutex_lock(priv->recv_lock);
+    priv->recv_quit = TRUE;
+    g_cond_signal(priv->recv_cond);
+    g_mutex_unlock(priv->recv_lock);
+    g_cancellable_cancel(priv->recv_cancel);
+
+    g_thread_join(priv->recv_thread);
+    priv->recv_thread = NULL;
+
+    g_object_unref(priv->recv_cancel);
+    priv->recv_cancel = NULL;
+    g_cond_free(priv->recv_cond);
+    priv->recv_cond = NULL;
+    g_mutex_free(priv->recv_lock);
+    priv->recv_lock = NULL;
+#ifdef HAVE_SASL
+    g_mutex_free(priv->sasl_lock);
+    priv->sasl_lock = NULL;
+#endif
+    g_free(priv->recv_queue);
+    priv->recv_queue = NULL;
+    priv->recv_queue_offset = priv->recv_queue_size = 0;
+}
+
+
+/*
+ * Read at least 1 more byte of data into the internal read_buffer
+ */
+static int vnc_connection_read_buf(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+#ifdef HAVE_SASL
+    if (priv->saslconn && !priv->recv_thread)
+        return vnc_connection_read_sasl(conn);
+#endif
+    if (priv->recv_thread)
+        return vnc_connection_read_queue(conn);
+
+    return vnc_connection_read_plain(conn);
+}
+
+/*
+ * Fill the 'data' buffer up with exactly 'len' bytes worth of data
+ *
+ * Must only be called from the VNC coroutine
+ */
+static int vnc_connection_read(VncConnection *conn, void *data, size_t len)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    char *ptr = data;
+    size_t offset = 0;
+
+    if (priv->coroutine_stop) return -EINVAL;
+
+    while (offset < len) {
+        size_t tmp;
+
+        /* compressed data is buffered independently of the read buffer
+         * so we must by-pass it */
+        if (vnc_connection_use_compression(conn)) {
+            int ret = vnc_connection_zread(conn, ptr + offset, len);
+            if (ret == -1) {
+                vnc_connection_set_error(conn, "%s", "Failure decompressing data");
+                return -errno;
+            }
+            offset += ret;
+            continue;
+        } else if (priv->read_offset == priv->read_size) {
+            int ret = vnc_connection_read_buf(conn);
+
+            if (ret < 0)
+                return ret;
+            priv->read_offset = 0;
+            priv->read_size = ret;
+        }
+
+        tmp = MIN(priv->read_size - priv->read_offset, len - offset);
+
+        memcpy(ptr + offset, priv->read_buffer + priv->read_offset, tmp);
+
+        priv->read_offset += tmp;
+        offset += tmp;
+    }
+
+    return 0;
+}
+
+/*
+ * Borrow 'size' bytes of scratch space for decoding. The
+ * arena is a simple bump allocator, so blocks must be
+ * released with vnc_connection_scratch_free in the reverse
+ * order to which they were taken. When the arena is too
+ * small the block comes from the heap instead, and the
+ * arena is grown to fit at the start of the next message,
+ * unless that would take it past VNC_CONNECTION_SCRATCH_MAX
+ *
+ * Must only be called from the VNC coroutine
+ */
+static gpointer vnc_connection_scratch_alloc(VncConnection *conn, gsize size)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    gpointer ptr;
+
+    /* keep every block non-empty and suitably aligned
+     * for any pixel type */
+    size = (MAX(size, 1) + 15) & ~(gsize)15;
+
+    if (priv->scratch_used + size > priv->scratch_size) {
+        if (priv->scratch_used + size <= VNC_CONNECTION_SCRATCH_MAX)
+            priv->scratch_wanted = MAX(priv->scratch_wanted,
+                                       priv->scratch_used + size);
+        return g_malloc(size);
+    }
+
+    ptr = priv->scratch + priv->scratch_used;
+    priv->scratch_used += size;
+
+    return ptr;
+}
+
+/*
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_scratch_free(VncConnection *conn, gpointer ptr)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    guint8 *p = ptr;
+
+    if (p >= priv->scratch && p < priv->scratch + priv->scratch_size)
+        priv->scratch_used = MIN(priv->scratch_used,
+                                 (gsize)(p - priv->scratch));
+    else
+        g_free(ptr);
+}
+
+/*
+ * Called between messages, when nothing is borrowed from
+ * the arena, to grow it to the high water mark seen so far
+ *
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_scratch_reset(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    priv->scratch_used = 0;
+
+    if (priv->scratch_wanted > priv->scratch_size) {
+        g_free(priv->scratch);
+        priv->scratch_size = priv->scratch_wanted;
+        priv->scratch = g_malloc(priv->scratch_size);
+        priv->scratch_peak = MAX(priv->scratch_peak, priv->scratch_size);
+        VNC_DEBUG("Grew scratch arena to %" G_GSIZE_FORMAT " bytes",
+                  priv->scratch_size);
+    }
+}
+
+/*
+ * Write all 'data' of length 'datalen' bytes out to
+ * the wire
+ */
+static void vnc_connection_flush_wire(VncConnection *conn,
+                                      const void *data,
+                                      size_t datalen)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    const char *ptr = data;
+    size_t offset = 0;
+    //VNC_DEBUG("Flush write %p %d", data, datalen);
+    while (offset < datalen) {
+        int ret;
+        gboolean blocking = FALSE;
+
+        if (priv->coroutine_stop) return;
+
+        if (priv->tls_session) {
+            ret = gnutls_write(priv->tls_session,
+                               ptr+offset,
+                               datalen-offset);
+            if (ret < 0) {
+                if (ret == GNUTLS_E_AGAIN)
+                    blocking = TRUE;
+                ret = -1;
+            }
+        } else {
+            GError *error = NULL;
+            ret = g_socket_send(priv->sock,
+                                ptr+offset,
+                                datalen-offset,
+                                NULL, &error);
+            if (ret < 0) {
+                if (error) {
+                    if (error->code == G_IO_ERROR_WOULD_BLOCK)
+                        blocking = TRUE;
+                    g_error_free(error);
+                }
+                ret = -1;
+            }
+        }
+        if (ret == -1) {
+            if (blocking) {
+                g_io_wait(priv->sock, G_IO_OUT);
+            } else {
+                vnc_connection_set_error(conn, "%s", "Failed to flush data");
+                return;
             }
         }
         if (ret == 0) {
@@ -1007,10 +1840,14 @@ static void vnc_connection_flush_sasl(VncConnection *conn)
     unsigned int outputlen;
     int err;
 
+    if (priv->sasl_lock)
+        g_mutex_lock(priv->sasl_lock);
     err = sasl_encode(priv->saslconn,
                       priv->write_buffer,
                       priv->write_offset,
                       &output, &outputlen);
+    if (priv->sasl_lock)
+        g_mutex_unlock(priv->sasl_lock);
     if (err != SASL_OK) {
         vnc_connection_set_error(conn, "Failed to encode SASL data %s",
                                  sasl_errstring(err, NULL, NULL));
@@ -1144,23 +1981,66 @@ static size_t vnc_connection_pixel_size(VncConnection *conn)
 }
 
 /*
+ * Return a pointer to the next 'len' bytes if they are already
+ * sitting in the current read or uncompressed buffer, consuming
+ * them, otherwise NULL and the caller must take the slow path
+ * through vnc_connection_read
+ *
  * Must only be called from the VNC coroutine
  */
-static void vnc_connection_read_pixel(VncConnection *conn, guint8 *pixel)
+static inline const guint8 *vnc_connection_read_buffered(VncConnection *conn,
+                                                         size_t len)
 {
-    vnc_connection_read(conn, pixel, vnc_connection_pixel_size(conn));
+    VncConnectionPrivate *priv = conn->priv;
+    const guint8 *ptr;
+
+    if (G_UNLIKELY(priv->coroutine_stop))
+        return NULL;
+
+    if (priv->compressed_buffer != NULL) {
+        if (priv->uncompressed_size - priv->uncompressed_offset < len)
+            return NULL;
+        ptr = priv->uncompressed_buffer + priv->uncompressed_offset;
+        priv->uncompressed_offset += len;
+    } else {
+        if (priv->read_size - priv->read_offset < len)
+            return NULL;
+        ptr = (const guint8 *)priv->read_buffer + priv->read_offset;
+        priv->read_offset += len;
+    }
+
+    return ptr;
 }
 
 /*
  * Must only be called from the VNC coroutine
  */
-static guint8 vnc_connection_read_u8(VncConnection *conn)
+static inline guint8 vnc_connection_read_u8(VncConnection *conn)
 {
+    const guint8 *ptr = vnc_connection_read_buffered(conn, 1);
     guint8 value = 0;
+
+    if (G_LIKELY(ptr != NULL))
+        return ptr[0];
+
     vnc_connection_read(conn, &value, sizeof(value));
     return value;
 }
 
+/*
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_read_pixel(VncConnection *conn, guint8 *pixel)
+{
+    int bpp = vnc_connection_pixel_size(conn);
+    const guint8 *ptr = vnc_connection_read_buffered(conn, bpp);
+
+    if (G_LIKELY(ptr != NULL))
+        memcpy(pixel, ptr, bpp);
+    else
+        vnc_connection_read(conn, pixel, bpp);
+}
+
 /*
  * Must only be called from the VNC coroutine
  */
@@ -1179,9 +2059,14 @@ static int vnc_connection_read_u8_interruptable(VncConnection *conn, guint8 *val
 /*
  * Must only be called from the VNC coroutine
  */
-static guint16 vnc_connection_read_u16(VncConnection *conn)
+static inline guint16 vnc_connection_read_u16(VncConnection *conn)
 {
+    const guint8 *ptr = vnc_connection_read_buffered(conn, 2);
     guint16 value = 0;
+
+    if (G_LIKELY(ptr != NULL))
+        return (ptr[0] << 8) | ptr[1];
+
     vnc_connection_read(conn, &value, sizeof(value));
     return g_ntohs(value);
 }
@@ -1189,9 +2074,15 @@ static guint16 vnc_connection_read_u16(VncConnection *conn)
 /*
  * Must only be called from the VNC coroutine
  */
-static guint32 vnc_connection_read_u32(VncConnection *conn)
+static inline guint32 vnc_connection_read_u32(VncConnection *conn)
 {
+    const guint8 *ptr = vnc_connection_read_buffered(conn, 4);
     guint32 value = 0;
+
+    if (G_LIKELY(ptr != NULL))
+        return ((guint32)ptr[0] << 24) | (ptr[1] << 16) |
+            (ptr[2] << 8) | ptr[3];
+
     vnc_connection_read(conn, &value, sizeof(value));
     return g_ntohl(value);
 }
@@ -1201,9 +2092,7 @@ static guint32 vnc_connection_read_u32(VncConnection *conn)
  */
 static gint32 vnc_connection_read_s32(VncConnection *conn)
 {
-    gint32 value = 0;
-    vnc_connection_read(conn, &value, sizeof(value));
-    return g_ntohl(value);
+    return (gint32)vnc_connection_read_u32(conn);
 }
 
 /*
@@ -1480,122 +2369,259 @@ static int vnc_connection_validate_certificate(VncConnection *conn)
         }
     }
 
-    return TRUE;
+    return TRUE;
+}
+
+
+static void vnc_connection_read_pixel_format(VncConnection *conn, VncPixelFormat *fmt)
+{
+    guint8 pad[3];
+
+    fmt->bits_per_pixel  = vnc_connection_read_u8(conn);
+    fmt->depth           = vnc_connection_read_u8(conn);
+    fmt->byte_order      = vnc_connection_read_u8(conn) ? G_BIG_ENDIAN : G_LITTLE_ENDIAN;
+    fmt->true_color_flag = vnc_connection_read_u8(conn);
+
+    fmt->red_max         = vnc_connection_read_u16(conn);
+    fmt->green_max       = vnc_connection_read_u16(conn);
+    fmt->blue_max        = vnc_connection_read_u16(conn);
+
+    fmt->red_shift       = vnc_connection_read_u8(conn);
+    fmt->green_shift     = vnc_connection_read_u8(conn);
+    fmt->blue_shift      = vnc_connection_read_u8(conn);
+
+    vnc_connection_read(conn, pad, 3);
+
+    VNC_DEBUG("Pixel format BPP: %d,  Depth: %d, Byte order: %d, True color: %d\n"
+              "             Mask  red: %3d, green: %3d, blue: %3d\n"
+              "             Shift red: %3d, green: %3d, blue: %3d",
+              fmt->bits_per_pixel, fmt->depth, fmt->byte_order, fmt->true_color_flag,
+              fmt->red_max, fmt->green_max, fmt->blue_max,
+              fmt->red_shift, fmt->green_shift, fmt->blue_shift);
+}
+
+static void vnc_connection_ledstate_change(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    struct signal_data sigdata;
+
+    priv->ledstate = vnc_connection_read_u8(conn);
+
+    VNC_DEBUG("LED state: %d\n", priv->ledstate);
+
+    sigdata.params.ledstate = priv->ledstate;
+    vnc_connection_emit_async(conn, VNC_LED_STATE, &sigdata);
+}
+
+/* initialize function */
+
+/**
+ * vnc_connection_has_error:
+ * @conn: (transfer none): the connection object
+ *
+ * Determine if the current connection is in an error
+ * state
+ *
+ * Returns: TRUE if an error has occurred, FALSE otherwise
+ */
+gboolean vnc_connection_has_error(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    return priv->coroutine_stop;
+}
+
+/**
+ * vnc_connection_get_pixel_format:
+ * @conn: (transfer none): the connection object
+ *
+ * Get a specification of the current pixel format
+ *
+ * Returns: (transfer none): the current pixel format
+ */
+const VncPixelFormat *vnc_connection_get_pixel_format(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    return &priv->fmt;
+}
+
+
+/**
+ * vnc_connection_set_shared:
+ * @conn: (transfer none): the connection object
+ * @sharedFlag: the new sharing state
+ *
+ * Set the shared state for the connection. A TRUE value
+ * allow allow this client to co-exist with other existing
+ * clients. A FALSE value will cause other clients to be
+ * dropped
+ *
+ * Returns: TRUE if the connection is ok, FALSE if it has an error
+ */
+gboolean vnc_connection_set_shared(VncConnection *conn, gboolean sharedFlag)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    if (vnc_connection_is_open(conn))
+        return FALSE;
+
+    priv->sharedFlag = sharedFlag;
+
+    return !vnc_connection_has_error(conn);
+}
+
+
+/**
+ * vnc_connection_get_shared:
+ * @conn: (transfer none): the connection object
+ *
+ * Get the sharing state for the connection
+ *
+ * Returns: TRUE if other clients are permitted, FALSE otherwise
+ */
+gboolean vnc_connection_get_shared(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    return priv->sharedFlag;
 }
 
 
-static void vnc_connection_read_pixel_format(VncConnection *conn, VncPixelFormat *fmt)
+/**
+ * vnc_connection_set_threaded_receive:
+ * @conn: (transfer none): the connection object
+ * @threaded: whether to use a receive thread
+ *
+ * Set whether data is read off the socket by a dedicated
+ * background thread, including any TLS / SASL decryption,
+ * once the protocol is initialized. This lets the network
+ * receive overlap with decoding of framebuffer updates.
+ * This can only be changed while the connection is closed.
+ *
+ * Returns: TRUE if the connection is ok, FALSE if it has an error
+ */
+gboolean vnc_connection_set_threaded_receive(VncConnection *conn, gboolean threaded)
 {
-    guint8 pad[3];
-
-    fmt->bits_per_pixel  = vnc_connection_read_u8(conn);
-    fmt->depth           = vnc_connection_read_u8(conn);
-    fmt->byte_order      = vnc_connection_read_u8(conn) ? G_BIG_ENDIAN : G_LITTLE_ENDIAN;
-    fmt->true_color_flag = vnc_connection_read_u8(conn);
-
-    fmt->red_max         = vnc_connection_read_u16(conn);
-    fmt->green_max       = vnc_connection_read_u16(conn);
-    fmt->blue_max        = vnc_connection_read_u16(conn);
+    VncConnectionPrivate *priv = conn->priv;
 
-    fmt->red_shift       = vnc_connection_read_u8(conn);
-    fmt->green_shift     = vnc_connection_read_u8(conn);
-    fmt->blue_shift      = vnc_connection_read_u8(conn);
+    if (vnc_connection_is_open(conn))
+        return FALSE;
 
-    vnc_connection_read(conn, pad, 3);
+    priv->recv_threaded = threaded;
 
-    VNC_DEBUG("Pixel format BPP: %d,  Depth: %d, Byte order: %d, True color: %d\n"
-              "             Mask  red: %3d, green: %3d, blue: %3d\n"
-              "             Shift red: %3d, green: %3d, blue: %3d",
-              fmt->bits_per_pixel, fmt->depth, fmt->byte_order, fmt->true_color_flag,
-              fmt->red_max, fmt->green_max, fmt->blue_max,
-              fmt->red_shift, fmt->green_shift, fmt->blue_shift);
+    return !vnc_connection_has_error(conn);
 }
 
-static void vnc_connection_ledstate_change(VncConnection *conn)
+
+/**
+ * vnc_connection_get_threaded_receive:
+ * @conn: (transfer none): the connection object
+ *
+ * Get whether data is read off the socket by a dedicated
+ * background thread
+ *
+ * Returns: TRUE if a receive thread is used, FALSE otherwise
+ */
+gboolean vnc_connection_get_threaded_receive(VncConnection *conn)
 {
     VncConnectionPrivate *priv = conn->priv;
-    struct signal_data sigdata;
-
-    priv->ledstate = vnc_connection_read_u8(conn);
-
-    VNC_DEBUG("LED state: %d\n", priv->ledstate);
 
-    sigdata.params.ledstate = priv->ledstate;
-    vnc_connection_emit_main_context(conn, VNC_LED_STATE, &sigdata);
+    return priv->recv_threaded;
 }
 
-/* initialize function */
 
 /**
- * vnc_connection_has_error:
+ * vnc_connection_set_decode_threads:
  * @conn: (transfer none): the connection object
+ * @threads: maximum number of decode worker threads
  *
- * Determine if the current connection is in an error
- * state
+ * Set how many worker threads may be used to decode
+ * framebuffer updates off the VNC coroutine. Tight
+ * encoded rects are spread across up to four workers,
+ * one per zlib stream, while ZRLE rects are inflated
+ * in the coroutine and their tiles rendered across all
+ * the workers. Tight JPEG rects are decoded as soon as
+ * their data has arrived, on any free worker. Rects are always written to the
+ * framebuffer in the order they were received, before
+ * the framebuffer update signal is emitted for them. A
+ * value of zero decodes everything in the coroutine.
+ * This can only be changed while the connection is closed.
  *
- * Returns: TRUE if an error has occurred, FALSE otherwise
+ * Returns: TRUE if the connection is ok, FALSE if it has an error
  */
-gboolean vnc_connection_has_error(VncConnection *conn)
+gboolean vnc_connection_set_decode_threads(VncConnection *conn, int threads)
 {
     VncConnectionPrivate *priv = conn->priv;
 
-    return priv->coroutine_stop;
+    if (vnc_connection_is_open(conn) || threads < 0)
+        return FALSE;
+
+    priv->decode_threads = threads;
+
+    return !vnc_connection_has_error(conn);
 }
 
+
 /**
- * vnc_connection_get_pixel_format:
+ * vnc_connection_get_decode_threads:
  * @conn: (transfer none): the connection object
  *
- * Get a specification of the current pixel format
+ * Get the maximum number of decode worker threads
  *
- * Returns: (transfer none): the current pixel format
+ * Returns: the number of threads, or zero if decoding is not threaded
  */
-const VncPixelFormat *vnc_connection_get_pixel_format(VncConnection *conn)
+int vnc_connection_get_decode_threads(VncConnection *conn)
 {
     VncConnectionPrivate *priv = conn->priv;
 
-    return &priv->fmt;
+    return priv->decode_threads;
 }
 
 
 /**
- * vnc_connection_set_shared:
+ * vnc_connection_set_stack_size:
  * @conn: (transfer none): the connection object
- * @sharedFlag: the new sharing state
+ * @size: size in bytes of the coroutine stack
  *
- * Set the shared state for the connection. A TRUE value
- * allow allow this client to co-exist with other existing
- * clients. A FALSE value will cause other clients to be
- * dropped
+ * Set the size of the stack for the coroutine running
+ * the protocol, which defaults to 16 MB. Stacks are only
+ * backed by memory as they are used, and are reused by
+ * later connections, but each costs @size bytes of
+ * address space. With debugging enabled, the most stack
+ * used is reported when the connection closes, to help
+ * choose a size. This can only be changed while the
+ * connection is closed.
  *
  * Returns: TRUE if the connection is ok, FALSE if it has an error
  */
-gboolean vnc_connection_set_shared(VncConnection *conn, gboolean sharedFlag)
+gboolean vnc_connection_set_stack_size(VncConnection *conn, gsize size)
 {
     VncConnectionPrivate *priv = conn->priv;
 
-    if (vnc_connection_is_open(conn))
+    if (vnc_connection_is_open(conn) || size < (64 << 10))
         return FALSE;
 
-    priv->sharedFlag = sharedFlag;
+    priv->coroutine_stack_size = size;
 
     return !vnc_connection_has_error(conn);
 }
 
 
 /**
- * vnc_connection_get_shared:
+ * vnc_connection_get_stack_size:
  * @conn: (transfer none): the connection object
  *
- * Get the sharing state for the connection
+ * Get the size of the stack for the coroutine running
+ * the protocol
  *
- * Returns: TRUE if other clients are permitted, FALSE otherwise
+ * Returns: the stack size in bytes
  */
-gboolean vnc_connection_get_shared(VncConnection *conn)
+gsize vnc_connection_get_stack_size(VncConnection *conn)
 {
     VncConnectionPrivate *priv = conn->priv;
 
-    return priv->sharedFlag;
+    return priv->coroutine_stack_size;
 }
 
 
@@ -1704,6 +2730,12 @@ gboolean vnc_connection_set_pixel_format(VncConnection *conn,
     vnc_connection_buffered_write(conn, pad, 3);
     vnc_connection_buffered_flush(conn);
 
+#ifdef HAVE_GIOUNIX
+    /* Shared pixels are in the old format until the server
+     * shares memory in the new one */
+    vnc_connection_shm_release(conn);
+#endif
+
     memcpy(&priv->fmt, fmt, sizeof(*fmt));
 
     return !vnc_connection_has_error(conn);
@@ -1889,16 +2921,42 @@ gboolean vnc_connection_set_encodings(VncConnection *conn, int n_encoding, gint3
             skip_zrle++;
         }
 
+#ifdef HAVE_GIOUNIX
+    /*
+     * Over a plain local socket, offer to share the server's
+     * framebuffer memory instead of having pixels sent. File
+     * descriptors can only be passed on UNIX sockets, and only
+     * make sense without a TLS layer in between
+     */
+#ifdef F_GET_SEALS
+    if (!priv->shm_requested &&
+        !priv->tls_session &&
+        g_socket_get_family(priv->sock) == G_SOCKET_FAMILY_UNIX) {
+        VNC_DEBUG("Requesting shared memory framebuffer");
+        priv->shm_requested = TRUE;
+    }
+#endif
+#endif
+
     priv->has_ext_key_event = FALSE;
     priv->has_audio = FALSE;
     vnc_connection_buffered_write_u8(conn, VNC_CONNECTION_CLIENT_MESSAGE_SET_ENCODINGS);
     vnc_connection_buffered_write(conn, pad, 1);
+#ifdef HAVE_GIOUNIX
+    vnc_connection_buffered_write_u16(conn, n_encoding - skip_zrle +
+                                      (priv->shm_requested ? 1 : 0));
+#else
     vnc_connection_buffered_write_u16(conn, n_encoding - skip_zrle);
+#endif
     for (i = 0; i < n_encoding; i++) {
         if (skip_zrle && encoding[i] == VNC_CONNECTION_ENCODING_ZRLE)
             continue;
         vnc_connection_buffered_write_s32(conn, encoding[i]);
     }
+#ifdef HAVE_GIOUNIX
+    if (priv->shm_requested)
+        vnc_connection_buffered_write_s32(conn, VNC_CONNECTION_ENCODING_SHARED_MEMORY);
+#endif
     vnc_connection_buffered_flush(conn);
     return !vnc_connection_has_error(conn);
 }
@@ -2176,9 +3234,9 @@ static void vnc_connection_raw_update(VncConnection *conn,
     VncConnectionPrivate *priv = conn->priv;
 
     /* optimize for perfect match between server/client
-       FWIW, in the local case, we ought to be doing a write
-       directly from the source framebuffer and a read directly
-       into the client framebuffer
+       FWIW, in the local case, servers can avoid sending the
+       pixels at all with the shared memory extension, see
+       vnc_connection_shm_setup
     */
     if (vnc_framebuffer_perfect_format_match(priv->fb)) {
         int i;
@@ -2196,14 +3254,178 @@ static void vnc_connection_raw_update(VncConnection *conn,
         guint8 *dst;
         int i;
 
-        dst = g_malloc(width * (priv->fmt.bits_per_pixel / 8));
+        dst = vnc_connection_scratch_alloc(conn, width * (priv->fmt.bits_per_pixel / 8));
         for (i = 0; i < height; i++) {
             vnc_connection_read(conn, dst, width * (priv->fmt.bits_per_pixel / 8));
             vnc_framebuffer_blt(priv->fb, dst, 0, x, y + i, width, 1);
         }
-        g_free(dst);
+        vnc_connection_scratch_free(conn, dst);
+    }
+}
+
+#ifdef HAVE_GIOUNIX
+static void vnc_connection_shm_release(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    if (priv->shm_map) {
+        VNC_DEBUG("Releasing shared memory framebuffer");
+        munmap(priv->shm_map, priv->shm_map_size);
+        priv->shm_map = NULL;
+        priv->shm_pixels = NULL;
+        priv->shm_map_size = 0;
+        priv->shm_stride = 0;
+    }
+}
+
+static int vnc_connection_shm_claim_fd(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int fd = -1;
+
+    g_mutex_lock(priv->shm_lock);
+    if (!g_queue_is_empty(&priv->shm_fds))
+        fd = GPOINTER_TO_INT(g_queue_pop_head(&priv->shm_fds));
+    g_mutex_unlock(priv->shm_lock);
+
+    return fd;
+}
+
+/*
+ * The server offers its framebuffer as shared memory. The
+ * rectangle carries the size of the shared area, and is
+ * followed by the row stride and the offset of the first
+ * pixel in the memory, as u32. A file descriptor for the
+ * memory is passed along with those bytes, and must be
+ * sealed with F_SEAL_SHRINK. Pixels are laid out in the
+ * pixel format the client asked for, so they can go
+ * straight into our framebuffer. A zero size means the
+ * server withdraws the shared memory again, and comes
+ * without a file descriptor.
+ *
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_shm_setup(VncConnection *conn,
+                                     guint16 width, guint16 height)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int bpp = priv->fmt.bits_per_pixel / 8;
+    guint32 stride, offset;
+    guint64 size;
+    struct stat st;
+    void *map;
+    int fd;
+    int seals = -1;
+
+    stride = vnc_connection_read_u32(conn);
+    offset = vnc_connection_read_u32(conn);
+    if (vnc_connection_has_error(conn))
+        return;
+
+    vnc_connection_shm_release(conn);
+
+    /* A withdraw carries no fd, so must not claim one
+     * which arrived early with the next setup */
+    if (width == 0 || height == 0) {
+        VNC_DEBUG("Server withdrew shared memory framebuffer");
+        return;
+    }
+
+    fd = vnc_connection_shm_claim_fd(conn);
+    if (fd == -1) {
+        vnc_connection_set_error(conn, "%s",
+                                 "Shared memory framebuffer without a file descriptor");
+        return;
+    }
+
+    if (width != priv->width || height != priv->height ||
+        stride < (guint32)width * bpp) {
+        vnc_connection_set_error(conn, "Shared memory framebuffer %dx%d stride %u "
+                                 "does not match desktop %dx%d",
+                                 width, height, stride, priv->width, priv->height);
+        close(fd);
+        return;
+    }
+
+    /* Unless the server can no longer shrink the memory,
+     * reading pixels past its new end would raise SIGBUS */
+#ifdef F_GET_SEALS
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && !(seals & F_SEAL_SHRINK))
+        seals = -1;
+#endif
+    if (seals < 0) {
+        vnc_connection_set_error(conn, "%s",
+                                 "Shared memory framebuffer is not sealed against shrinking");
+        close(fd);
+        return;
+    }
+
+    size = (guint64)offset + ((guint64)stride * height);
+    if (fstat(fd, &st) < 0 || (guint64)st.st_size < size) {
+        vnc_connection_set_error(conn, "%s",
+                                 "Shared memory framebuffer is too small");
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        vnc_connection_set_error(conn, "Unable to map shared memory framebuffer: %s",
+                                 g_strerror(errno));
+        return;
+    }
+
+    VNC_DEBUG("Mapped shared memory framebuffer %dx%d stride %u",
+              width, height, stride);
+    priv->shm_map = map;
+    priv->shm_map_size = size;
+    priv->shm_pixels = priv->shm_map + offset;
+    priv->shm_stride = stride;
+}
+
+/*
+ * An area of the shared memory changed. No pixel data
+ * follows, they are copied from the shared memory
+ *
+ * Returns TRUE if the framebuffer was updated
+ *
+ * Must only be called from the VNC coroutine
+ */
+static gboolean vnc_connection_shm_damage(VncConnection *conn,
+                                          guint16 x, guint16 y,
+                                          guint16 width, guint16 height)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int bpp = priv->fmt.bits_per_pixel / 8;
+
+    /*
+     * Damage sent before the server saw a change of pixel
+     * format arrives after the memory is released. Ask for
+     * the pixels of that area to be sent instead
+     */
+    if (!priv->shm_pixels) {
+        VNC_DEBUG("Shared memory damage at %d,%d size %dx%d without a shared framebuffer",
+                  x, y, width, height);
+        vnc_connection_write_u8(conn, VNC_CONNECTION_CLIENT_MESSAGE_FRAMEBUFFER_UPDATE_REQUEST);
+        vnc_connection_write_u8(conn, 0);
+        vnc_connection_write_u16(conn, x);
+        vnc_connection_write_u16(conn, y);
+        vnc_connection_write_u16(conn, width);
+        vnc_connection_write_u16(conn, height);
+        vnc_connection_flush(conn);
+        return FALSE;
     }
+
+    vnc_framebuffer_blt(priv->fb,
+                        priv->shm_pixels + (y * priv->shm_stride) + (x * bpp),
+                        priv->shm_stride,
+                        x, y, width, height);
+    return TRUE;
 }
+#endif
+
 
 static void vnc_connection_copyrect_update(VncConnection *conn,
                                            guint16 dst_x, guint16 dst_y,
@@ -2221,6 +3443,30 @@ static void vnc_connection_copyrect_update(VncConnection *conn,
                              width, height);
 }
 
+/*
+ * Replicate a single remote format pixel 'count' times. The
+ * first copy seeds the run, which is then doubled with each
+ * memcpy so long runs only take a handful of calls
+ */
+static void vnc_connection_fill_run(guint8 *dst, const guint8 *pixel,
+                                    int bpp, int count)
+{
+    size_t len = (size_t)count * bpp;
+    size_t done;
+
+    if (count <= 0)
+        return;
+
+    if (bpp == 1) {
+        memset(dst, pixel[0], count);
+        return;
+    }
+
+    memcpy(dst, pixel, bpp);
+    for (done = bpp; done < len; done *= 2)
+        memcpy(dst + done, dst, MIN(done, len - done));
+}
+
 static void vnc_connection_hextile_rect(VncConnection *conn,
                                         guint8 flags,
                                         guint16 x, guint16 y,
@@ -2228,7 +3474,7 @@ static void vnc_connection_hextile_rect(VncConnection *conn,
                                         guint8 *fg, guint8 *bg)
 {
     VncConnectionPrivate *priv = conn->priv;
-    int i;
+    int i, j;
 
     if (flags & 0x01) {
         vnc_connection_raw_update(conn, x, y, width, height);
@@ -2241,26 +3487,48 @@ static void vnc_connection_hextile_rect(VncConnection *conn,
         if (flags & 0x04)
             vnc_connection_read_pixel(conn, fg);
 
-        vnc_framebuffer_fill(priv->fb, bg, x, y, width, height);
-
         /* AnySubrects */
         if (flags & 0x08) {
+            int bpp = vnc_connection_pixel_size(conn);
             guint8 n_rects = vnc_connection_read_u8(conn);
+            int size = 2 + ((flags & 0x10) ? bpp : 0);
+            guint8 subrects[255 * 6];
+            guint8 tile[16 * 16 * 4];
+            const guint8 *sr = subrects;
+
+            /* fetch all the subrects at once and paint them into
+             * a scratch tile, so the framebuffer is touched once */
+            if (vnc_connection_read(conn, subrects, n_rects * size) < 0)
+                return;
+
+            for (j = 0; j < height; j++)
+                vnc_connection_fill_run(tile + (j * width * bpp), bg,
+                                        bpp, width);
 
             for (i = 0; i < n_rects; i++) {
-                guint8 xy, wh;
+                int sx, sy, sw, sh;
 
                 /* SubrectsColored */
-                if (flags & 0x10)
-                    vnc_connection_read_pixel(conn, fg);
+                if (flags & 0x10) {
+                    memcpy(fg, sr, bpp);
+                    sr += bpp;
+                }
 
-                xy = vnc_connection_read_u8(conn);
-                wh = vnc_connection_read_u8(conn);
+                sx = nibhi(sr[0]);
+                sy = niblo(sr[0]);
+                sw = MIN(nibhi(sr[1]) + 1, width - sx);
+                sh = MIN(niblo(sr[1]) + 1, height - sy);
+                sr += 2;
 
-                vnc_framebuffer_fill(priv->fb, fg,
-                                     x + nibhi(xy), y + niblo(xy),
-                                     nibhi(wh) + 1, niblo(wh) + 1);
+                for (j = 0; j < sh; j++)
+                    vnc_connection_fill_run(tile + ((((sy + j) * width) + sx) * bpp),
+                                            fg, bpp, sw);
             }
+
+            vnc_framebuffer_blt(priv->fb, tile, width * bpp,
+                                x, y, width, height);
+        } else {
+            vnc_framebuffer_fill(priv->fb, bg, x, y, width, height);
         }
     }
 }
@@ -2320,12 +3588,113 @@ static void vnc_connection_rre_update(VncConnection *conn,
 
 /* CPIXELs are optimized slightly.  32-bit pixel values are packed into 24-bit
  * values. */
-static void vnc_connection_read_cpixel(VncConnection *conn, guint8 *pixel)
+static void vnc_connection_decode_job_free(struct decode_job *job)
+{
+    g_free(job->zlib_data);
+    g_free(job->data);
+    g_free(job->pixels);
+    g_free(job->tile_offsets);
+    g_free(job->bands);
+    if (job->pixbuf)
+        g_object_unref(job->pixbuf);
+    g_free(job);
+}
+
+/*
+ * Called by a worker as it finishes one of the job's
+ * 'pending' pieces of work
+ */
+static void vnc_connection_decode_job_complete(struct decode_job *job,
+                                               gboolean failed)
+{
+    VncConnectionPrivate *priv = job->conn->priv;
+
+    g_mutex_lock(priv->decode_lock);
+    if (failed)
+        job->failed = TRUE;
+    if (--job->pending <= 0)
+        job->done = TRUE;
+    g_mutex_unlock(priv->decode_lock);
+
+    /* Kick the main loop so the coroutine's condition
+     * wait gets re-checked */
+    g_main_context_wakeup(NULL);
+}
+
+static gboolean vnc_connection_decode_job_is_done(gpointer opaque)
+{
+    struct decode_job *job = opaque;
+    VncConnectionPrivate *priv = job->conn->priv;
+    gboolean done;
+
+    if (priv->coroutine_stop)
+        return TRUE;
+
+    g_mutex_lock(priv->decode_lock);
+    done = job->done;
+    g_mutex_unlock(priv->decode_lock);
+
+    return done;
+}
+
+/*
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_decode_queue(VncConnection *conn,
+                                        struct decode_job *job,
+                                        GThreadPool *pool)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    if (!priv->decode_lock)
+        priv->decode_lock = g_mutex_new();
+
+    g_queue_push_tail(&priv->decode_pending, job);
+    if (pool)
+        g_thread_pool_push(pool, job, NULL);
+}
+
+static void vnc_connection_decode_stop(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    struct decode_job *job;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (priv->tight_pool[i]) {
+            g_thread_pool_free(priv->tight_pool[i], TRUE, TRUE);
+            priv->tight_pool[i] = NULL;
+        }
+    }
+    if (priv->zrle_pool) {
+        g_thread_pool_free(priv->zrle_pool, TRUE, TRUE);
+        priv->zrle_pool = NULL;
+    }
+    if (priv->jpeg_pool) {
+        g_thread_pool_free(priv->jpeg_pool, TRUE, TRUE);
+        priv->jpeg_pool = NULL;
+    }
+
+    while ((job = g_queue_pop_head(&priv->decode_pending)))
+        vnc_connection_decode_job_free(job);
+
+    if (priv->decode_lock) {
+        g_mutex_free(priv->decode_lock);
+        priv->decode_lock = NULL;
+    }
+}
+
+
+/*
+ * Returns the number of bytes a ZRLE cpixel occupies on the
+ * wire, and the offset within the pixel they belong at
+ */
+static int vnc_connection_cpixel_size(VncConnection *conn, int *offset)
 {
     VncConnectionPrivate *priv = conn->priv;
     int bpp = vnc_connection_pixel_size(conn);
 
-    memset(pixel, 0, bpp);
+    *offset = 0;
 
     if (bpp == 4 && priv->fmt.true_color_flag) {
         int fitsInMSB = ((priv->fmt.red_shift > 7) &&
@@ -2335,21 +3704,115 @@ static void vnc_connection_read_cpixel(VncConnection *conn, guint8 *pixel)
                          ((priv->fmt.green_max << priv->fmt.green_shift) < (1 << 24)) &&
                          ((priv->fmt.blue_max << priv->fmt.blue_shift) < (1 << 24)));
 
-        /*
-         * We need to analyse the shifts to see if they fit in 3 bytes,
-         * rather than looking at the declared  'depth' for the format
-         * because despite what the RFB spec says, this is what RealVNC
-         * server actually does in practice.
-         */
-        if (fitsInMSB || fitsInLSB) {
-            bpp = 3;
-            if (priv->fmt.depth == 24 &&
-                priv->fmt.byte_order == G_BIG_ENDIAN)
-                pixel++;
+        /*
+         * We need to analyse the shifts to see if they fit in 3 bytes,
+         * rather than looking at the declared  'depth' for the format
+         * because despite what the RFB spec says, this is what RealVNC
+         * server actually does in practice.
+         */
+        if (fitsInMSB || fitsInLSB) {
+            bpp = 3;
+            if (priv->fmt.depth == 24 &&
+                priv->fmt.byte_order == G_BIG_ENDIAN)
+                *offset = 1;
+        }
+    }
+
+    return bpp;
+}
+
+static void vnc_connection_read_cpixel(VncConnection *conn, guint8 *pixel)
+{
+    int offset;
+    int size = vnc_connection_cpixel_size(conn, &offset);
+
+    memset(pixel, 0, vnc_connection_pixel_size(conn));
+    vnc_connection_read(conn, pixel + offset, size);
+}
+
+/*
+ * Read a ZRLE palette of cpixels with a single read,
+ * expanding each entry to a remote format pixel
+ */
+static void vnc_connection_read_cpalette(VncConnection *conn,
+                                         guint8 palette[][4],
+                                         int palette_size)
+{
+    int offset;
+    int size = vnc_connection_cpixel_size(conn, &offset);
+    guint8 cpixels[128 * 4];
+    int i;
+
+    vnc_connection_read(conn, cpixels, palette_size * size);
+
+    for (i = 0; i < palette_size; i++) {
+        memset(palette[i], 0, 4);
+        memcpy(palette[i] + offset, cpixels + (i * size), size);
+    }
+}
+
+/*
+ * Fill in the lookup table used to expand 1-bit palette
+ * indexes a nibble at a time. Each of the 16 entries holds
+ * the 4 remote format pixels for that nibble
+ */
+static void vnc_connection_palette_lut(const guint8 *palette, int bpp,
+                                       guint8 *lut)
+{
+    int n, k;
+
+    for (n = 0; n < 16; n++)
+        for (k = 0; k < 4; k++)
+            memcpy(lut + (((n * 4) + k) * bpp),
+                   palette + (((n >> (3 - k)) & 1) * 4), bpp);
+}
+
+/*
+ * Expand one row of packed palette indexes, 'bits' wide
+ * with the most significant first, into remote format
+ * pixels. 'palette' holds 4 bytes per entry and must have
+ * room for any index that fits in 'bits'. 'lut' is only
+ * used for 1-bit indexes, see vnc_connection_palette_lut
+ */
+static void vnc_connection_palette_expand_row(const guint8 *src, guint8 *dst,
+                                              int bits,
+                                              const guint8 *palette,
+                                              const guint8 *lut,
+                                              int bpp, guint16 width)
+{
+    int mask = (1 << bits) - 1;
+    int i = 0;
+
+    if (bits == 1) {
+        int chunk = bpp * 4;
+
+        for (; (i + 8) <= width; i += 8) {
+            guint8 b = src[i / 8];
+            memcpy(dst + (i * bpp), lut + ((b >> 4) * chunk), chunk);
+            memcpy(dst + ((i + 4) * bpp), lut + ((b & 0xf) * chunk), chunk);
+        }
+    } else if (bits == 8) {
+        switch (bpp) {
+        case 1:
+            for (; i < width; i++)
+                dst[i] = palette[src[i] * 4];
+            break;
+        case 2:
+            for (; i < width; i++)
+                memcpy(dst + (i * 2), palette + (src[i] * 4), 2);
+            break;
+        case 4:
+            for (; i < width; i++)
+                memcpy(dst + (i * 4), palette + (src[i] * 4), 4);
+            break;
         }
     }
 
-    vnc_connection_read(conn, pixel, bpp);
+    for (; i < width; i++) {
+        int bit = i * bits;
+        int ind = (src[bit / 8] >> (8 - bits - (bit % 8))) & mask;
+        memcpy(dst + (i * bpp), palette + (ind * 4), bpp);
+    }
 }
 
 static void vnc_connection_zrle_update_tile_blit(VncConnection *conn,
@@ -2360,7 +3823,7 @@ static void vnc_connection_zrle_update_tile_blit(VncConnection *conn,
     guint8 *blit_data;
     int i, bpp;
 
-    blit_data = g_new0(guint8, 4*64*64);
+    blit_data = vnc_connection_scratch_alloc(conn, 4*64*64);
 
     bpp = vnc_connection_pixel_size(conn);
 
@@ -2369,30 +3832,7 @@ static void vnc_connection_zrle_update_tile_blit(VncConnection *conn,
 
     vnc_framebuffer_blt(priv->fb, blit_data, width * bpp, x, y, width, height);
 
-    g_free(blit_data);
-}
-
-static guint8 vnc_connection_read_zrle_pi(VncConnection *conn, int palette_size)
-{
-    VncConnectionPrivate *priv = conn->priv;
-    guint8 pi = 0;
-
-    if (priv->zrle_pi_bits == 0) {
-        priv->zrle_pi = vnc_connection_read_u8(conn);
-        priv->zrle_pi_bits = 8;
-    }
-    if ( palette_size == 2) {
-        pi = (priv->zrle_pi >> (priv->zrle_pi_bits - 1)) & 1;
-        priv->zrle_pi_bits -= 1;
-    } else if ((palette_size == 3) || (palette_size == 4)) {
-        pi = (priv->zrle_pi >> (priv->zrle_pi_bits - 2)) & 3;
-        priv->zrle_pi_bits -= 2;
-    } else if ((palette_size >=5) && (palette_size <=16)){
-        pi = (priv->zrle_pi >> (priv->zrle_pi_bits - 4)) & 15;
-        priv->zrle_pi_bits -= 4;
-    }
-
-    return pi;
+    vnc_connection_scratch_free(conn, blit_data);
 }
 
 static void vnc_connection_zrle_update_tile_palette(VncConnection *conn,
@@ -2401,23 +3841,36 @@ static void vnc_connection_zrle_update_tile_palette(VncConnection *conn,
                                                     guint16 width, guint16 height)
 {
     VncConnectionPrivate *priv = conn->priv;
-    guint8 palette[128][4];
-    int i, j;
+    guint8 palette[16][4];
+    guint8 lut[16 * 4 * 4];
+    guint8 indexes[64 * 32]; /* 64 rows of 64 4-bit indexes */
+    guint8 *tile;
+    int bits = palette_size == 2 ? 1 : palette_size <= 4 ? 2 : 4;
+    int stride = ((width * bits) + 7) / 8;
+    int bpp = vnc_connection_pixel_size(conn);
+    int j;
 
-    for (i = 0; i < palette_size; i++)
-        vnc_connection_read_cpixel(conn, palette[i]);
+    memset(palette, 0, sizeof(palette));
+    vnc_connection_read_cpalette(conn, palette, palette_size);
 
-    for (j = 0; j < height; j++) {
-        /* discard any padding bits */
-        priv->zrle_pi_bits = 0;
+    /* each row is padded to a whole byte, so fetch them all at once */
+    vnc_connection_read(conn, indexes, stride * height);
+    if (vnc_connection_has_error(conn))
+        return;
 
-        for (i = 0; i < width; i++) {
-            int ind = vnc_connection_read_zrle_pi(conn, palette_size);
+    if (bits == 1)
+        vnc_connection_palette_lut(palette[0], bpp, lut);
 
-            vnc_framebuffer_set_pixel_at(priv->fb, palette[ind & 0x7F],
-                                         x + i, y + j);
-        }
-    }
+    tile = vnc_connection_scratch_alloc(conn, width * height * bpp);
+    for (j = 0; j < height; j++)
+        vnc_connection_palette_expand_row(indexes + (j * stride),
+                                          tile + (j * width * bpp),
+                                          bits, palette[0], lut,
+                                          bpp, width);
+
+    vnc_framebuffer_blt(priv->fb, tile, width * bpp, x, y, width, height);
+
+    vnc_connection_scratch_free(conn, tile);
 }
 
 static int vnc_connection_read_zrle_rl(VncConnection *conn)
@@ -2438,19 +3891,29 @@ static void vnc_connection_zrle_update_tile_rle(VncConnection *conn,
                                                 guint16 width, guint16 height)
 {
     VncConnectionPrivate *priv = conn->priv;
-    int i, j, rl = 0;
+    int bpp = vnc_connection_pixel_size(conn);
+    int npixels = width * height;
+    int i = 0;
     guint8 pixel[4];
+    guint8 *tile;
 
-    for (j = 0; j < height; j++) {
-        for (i = 0; i < width; i++) {
-            if (rl == 0) {
-                vnc_connection_read_cpixel(conn, pixel);
-                rl = vnc_connection_read_zrle_rl(conn);
-            }
-            vnc_framebuffer_set_pixel_at(priv->fb, pixel, x + i, y + j);
-            rl -= 1;
-        }
+    tile = vnc_connection_scratch_alloc(conn, npixels * bpp);
+
+    while (i < npixels && !vnc_connection_has_error(conn)) {
+        int rl;
+
+        vnc_connection_read_cpixel(conn, pixel);
+        rl = MIN(vnc_connection_read_zrle_rl(conn), npixels - i);
+
+        /* the tile buffer is contiguous, so runs may cross rows */
+        vnc_connection_fill_run(tile + (i * bpp), pixel, bpp, rl);
+        i += rl;
     }
+
+    if (!vnc_connection_has_error(conn))
+        vnc_framebuffer_blt(priv->fb, tile, width * bpp, x, y, width, height);
+
+    vnc_connection_scratch_free(conn, tile);
 }
 
 static void vnc_connection_zrle_update_tile_prle(VncConnection *conn,
@@ -2459,28 +3922,34 @@ static void vnc_connection_zrle_update_tile_prle(VncConnection *conn,
                                                  guint16 width, guint16 height)
 {
     VncConnectionPrivate *priv = conn->priv;
-    int i, j, rl = 0;
+    int bpp = vnc_connection_pixel_size(conn);
+    int npixels = width * height;
+    int i = 0;
     guint8 palette[128][4];
-    guint8 pi = 0;
+    guint8 *tile;
 
-    for (i = 0; i < palette_size; i++)
-        vnc_connection_read_cpixel(conn, palette[i]);
+    memset(palette, 0, sizeof(palette));
+    vnc_connection_read_cpalette(conn, palette, palette_size);
 
-    for (j = 0; j < height; j++) {
-        for (i = 0; i < width; i++) {
-            if (rl == 0) {
-                pi = vnc_connection_read_u8(conn);
-                if (pi & 0x80) {
-                    rl = vnc_connection_read_zrle_rl(conn);
-                    pi &= 0x7F;
-                } else
-                    rl = 1;
-            }
+    tile = vnc_connection_scratch_alloc(conn, npixels * bpp);
+
+    while (i < npixels && !vnc_connection_has_error(conn)) {
+        guint8 pi = vnc_connection_read_u8(conn);
+        int rl = 1;
 
-            vnc_framebuffer_set_pixel_at(priv->fb, palette[pi], x + i, y + j);
-            rl -= 1;
+        if (pi & 0x80) {
+            rl = MIN(vnc_connection_read_zrle_rl(conn), npixels - i);
+            pi &= 0x7F;
         }
+
+        vnc_connection_fill_run(tile + (i * bpp), palette[pi], bpp, rl);
+        i += rl;
     }
+
+    if (!vnc_connection_has_error(conn))
+        vnc_framebuffer_blt(priv->fb, tile, width * bpp, x, y, width, height);
+
+    vnc_connection_scratch_free(conn, tile);
 }
 
 static void vnc_connection_zrle_update_tile(VncConnection *conn, guint16 x, guint16 y,
@@ -2515,9 +3984,308 @@ static void vnc_connection_zrle_update_tile(VncConnection *conn, guint16 x, guin
     }
 }
 
-static void vnc_connection_zrle_update(VncConnection *conn,
-                                       guint16 x, guint16 y,
-                                       guint16 width, guint16 height)
+/*
+ * Parse a single ZRLE tile out of a block of inflated data
+ * starting at 'offset', which is advanced past the tile. If
+ * 'pixels' is non-NULL the tile is also rendered into it as
+ * remote format pixels. Only reads connection state which is
+ * fixed for the duration of a framebuffer update message, so
+ * may run on a decode worker thread
+ */
+static gboolean vnc_connection_zrle_decode_tile(VncConnection *conn,
+                                                const guint8 *data, size_t length,
+                                                size_t *offset,
+                                                guint8 *pixels, int rowstride,
+                                                guint16 width, guint16 height)
+{
+    int bpp = vnc_connection_pixel_size(conn);
+    int coffset;
+    int csize = vnc_connection_cpixel_size(conn, &coffset);
+    size_t off = *offset;
+    guint8 palette[128][4];
+    guint8 subencoding;
+    int npixels = width * height;
+    int i, j;
+
+#define ZRLE_NEED(n)                            \
+    do {                                        \
+        if ((n) > length - off)                 \
+            return FALSE;                       \
+    } while (0)
+
+#define ZRLE_LOAD_CPIXEL(pixel)                                 \
+    do {                                                        \
+        memset((pixel), 0, bpp);                                \
+        memcpy((pixel) + coffset, data + off, csize);           \
+        off += csize;                                           \
+    } while (0)
+
+#define ZRLE_PIXEL_AT(n)                                                \
+    (pixels + (((n) / width) * rowstride) + (((n) % width) * bpp))
+
+    ZRLE_NEED(1);
+    subencoding = data[off++];
+
+    if (subencoding == 0) {
+        /* Raw pixel data */
+        ZRLE_NEED((size_t)npixels * csize);
+        if (!pixels) {
+            off += (size_t)npixels * csize;
+        } else {
+            for (i = 0; i < npixels; i++)
+                ZRLE_LOAD_CPIXEL(ZRLE_PIXEL_AT(i));
+        }
+    } else if (subencoding == 1) {
+        /* Solid tile of a single color */
+        ZRLE_NEED(csize);
+        ZRLE_LOAD_CPIXEL(palette[0]);
+        if (pixels) {
+            for (i = 0; i < npixels; i++)
+                memcpy(ZRLE_PIXEL_AT(i), palette[0], bpp);
+        }
+    } else if ((subencoding >= 2) && (subencoding <= 16)) {
+        /* Packed palette types */
+        int bits = subencoding == 2 ? 1 : subencoding <= 4 ? 2 : 4;
+        int stride = ((width * bits) + 7) / 8;
+
+        ZRLE_NEED((size_t)subencoding * csize);
+        for (i = 0; i < subencoding; i++)
+            ZRLE_LOAD_CPIXEL(palette[i]);
+
+        ZRLE_NEED((size_t)stride * height);
+        if (pixels) {
+            guint8 lut[16 * 4 * 4];
+
+            if (bits == 1)
+                vnc_connection_palette_lut(palette[0], bpp, lut);
+
+            for (j = 0; j < height; j++)
+                vnc_connection_palette_expand_row(data + off + (j * stride),
+                                                  pixels + (j * rowstride),
+                                                  bits, palette[0], lut,
+                                                  bpp, width);
+        }
+        off += (size_t)stride * height;
+    } else if (subencoding == 128 || subencoding >= 130) {
+        /* Plain RLE, or palette RLE */
+        int palette_size = subencoding - 128;
+
+        ZRLE_NEED((size_t)palette_size * csize);
+        for (i = 0; i < palette_size; i++)
+            ZRLE_LOAD_CPIXEL(palette[i]);
+
+        i = 0;
+        while (i < npixels) {
+            guint8 pixel[4];
+            guint8 *src = pixel;
+            gboolean more = TRUE;
+            int rl = 1;
+
+            if (palette_size) {
+                guint8 pi;
+                ZRLE_NEED(1);
+                pi = data[off++];
+                src = palette[pi & 0x7F];
+                more = (pi & 0x80) != 0;
+            } else {
+                ZRLE_NEED(csize);
+                ZRLE_LOAD_CPIXEL(pixel);
+            }
+
+            while (more) {
+                guint8 b;
+                ZRLE_NEED(1);
+                b = data[off++];
+                rl += b;
+                more = b == 255;
+            }
+
+            rl = MIN(rl, npixels - i);
+            if (pixels) {
+                /* split the run at each row boundary */
+                for (j = 0; j < rl;) {
+                    int n = MIN(rl - j, width - ((i + j) % width));
+                    vnc_connection_fill_run(ZRLE_PIXEL_AT(i + j), src, bpp, n);
+                    j += n;
+                }
+            }
+            i += rl;
+        }
+    } else {
+        return FALSE;
+    }
+
+#undef ZRLE_PIXEL_AT
+#undef ZRLE_LOAD_CPIXEL
+#undef ZRLE_NEED
+
+    *offset = off;
+    return TRUE;
+}
+
+
+/*
+ * Inflate a complete ZRLE rect from stream 0, growing
+ * the output buffer as needed
+ */
+static guint8 *vnc_connection_zrle_inflate(VncConnection *conn,
+                                           guint8 *in, size_t inlen,
+                                           size_t *outlen)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    z_stream *strm = &priv->streams[0];
+    size_t capacity = MAX(inlen * 4, 4096);
+    guint8 *out = g_malloc(capacity);
+    size_t used = 0;
+
+    strm->next_in = in;
+    strm->avail_in = inlen;
+
+    for (;;) {
+        int err;
+
+        if (used == capacity) {
+            capacity *= 2;
+            out = g_realloc(out, capacity);
+        }
+
+        strm->next_out = out + used;
+        strm->avail_out = capacity - used;
+
+        err = inflate(strm, Z_SYNC_FLUSH);
+        used = capacity - strm->avail_out;
+
+        if (err == Z_BUF_ERROR && strm->avail_in == 0)
+            break;
+        if (err != Z_OK) {
+            g_free(out);
+            return NULL;
+        }
+        if (strm->avail_in == 0 && strm->avail_out != 0)
+            break;
+    }
+
+    *outlen = used;
+    return out;
+}
+
+
+/*
+ * Runs on the ZRLE render pool, drawing one band of
+ * tiles into the job's pixel buffer. Bands never overlap
+ * so need no locking against each other
+ */
+static void vnc_connection_zrle_band_run(gpointer data,
+                                         gpointer opaque G_GNUC_UNUSED)
+{
+    struct decode_band *band = data;
+    struct decode_job *job = band->job;
+    VncConnection *conn = job->conn;
+    int bpp = vnc_connection_pixel_size(conn);
+    gboolean failed = FALSE;
+    guint16 i;
+    int n;
+
+    for (i = 0, n = 0; i < job->width && !failed; i += 64, n++) {
+        size_t offset = band->tile_offsets[n];
+        guint8 *pixels = job->pixels +
+            (band->y * job->rowstride) + (i * bpp);
+
+        if (!vnc_connection_zrle_decode_tile(conn, job->data, job->data_size,
+                                             &offset, pixels, job->rowstride,
+                                             MIN(job->width - i, 64),
+                                             band->height))
+            failed = TRUE;
+    }
+
+    vnc_connection_decode_job_complete(job, failed);
+}
+
+
+/*
+ * Two stage ZRLE decoding. The zlib stream is inherently
+ * serial, so the rect is inflated and its tile boundaries
+ * located on the coroutine. The expensive part, rendering
+ * the pixels, is then spread across the decode workers
+ *
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_zrle_queue(VncConnection *conn,
+                                      guint8 *zlib_data, size_t length,
+                                      guint16 x, guint16 y,
+                                      guint16 width, guint16 height)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    struct decode_job *job;
+    int ntiles_x = (width + 63) / 64;
+    int nbands = (height + 63) / 64;
+    size_t offset = 0;
+    int i, j;
+
+    job = g_new0(struct decode_job, 1);
+    job->conn = conn;
+    job->commit = VNC_CONNECTION_DECODE_COMMIT_BLT;
+    job->x = x;
+    job->y = y;
+    job->width = width;
+    job->height = height;
+    job->rowstride = width * vnc_connection_pixel_size(conn);
+
+    job->data = vnc_connection_zrle_inflate(conn, zlib_data, length,
+                                            &job->data_size);
+    if (!job->data) {
+        vnc_connection_set_error(conn, "%s", "Failure decompressing data");
+        vnc_connection_decode_job_free(job);
+        return;
+    }
+
+    job->tile_offsets = g_new(size_t, ntiles_x * nbands);
+    job->bands = g_new0(struct decode_band, nbands);
+
+    for (j = 0; j < nbands; j++) {
+        struct decode_band *band = &job->bands[j];
+
+        band->job = job;
+        band->y = j * 64;
+        band->height = MIN(height - band->y, 64);
+        band->tile_offsets = job->tile_offsets + (j * ntiles_x);
+
+        for (i = 0; i < ntiles_x; i++) {
+            band->tile_offsets[i] = offset;
+            if (!vnc_connection_zrle_decode_tile(conn, job->data, job->data_size,
+                                                 &offset, NULL, 0,
+                                                 MIN(width - (i * 64), 64),
+                                                 band->height)) {
+                vnc_connection_set_error(conn, "%s", "Malformed ZRLE tile data");
+                vnc_connection_decode_job_free(job);
+                return;
+            }
+        }
+    }
+
+    if (!priv->zrle_pool) {
+        vnc_connection_threads_init();
+        priv->zrle_pool = g_thread_pool_new(vnc_connection_zrle_band_run,
+                                            NULL, priv->decode_threads,
+                                            FALSE, NULL);
+    }
+
+    job->pixels = g_malloc(job->rowstride * height);
+    job->pending = nbands;
+    vnc_connection_decode_queue(conn, job, NULL);
+
+    for (j = 0; j < nbands; j++)
+        g_thread_pool_push(priv->zrle_pool, &job->bands[j], NULL);
+}
+
+/*
+ * Returns TRUE if the rect has been written to the
+ * framebuffer, or FALSE if it was queued for the
+ * decode workers and will be committed later
+ */
+static gboolean vnc_connection_zrle_update(VncConnection *conn,
+                                           guint16 x, guint16 y,
+                                           guint16 width, guint16 height)
 {
     VncConnectionPrivate *priv = conn->priv;
     guint32 length;
@@ -2525,9 +4293,17 @@ static void vnc_connection_zrle_update(VncConnection *conn,
     guint8 *zlib_data;
 
     length = vnc_connection_read_u32(conn);
-    zlib_data = g_malloc(length);
+    zlib_data = vnc_connection_scratch_alloc(conn, length);
     vnc_connection_read(conn, zlib_data, length);
 
+    if (priv->decode_threads) {
+        if (!vnc_connection_has_error(conn))
+            vnc_connection_zrle_queue(conn, zlib_data, length,
+                                      x, y, width, height);
+        vnc_connection_scratch_free(conn, zlib_data);
+        return FALSE;
+    }
+
     /* setup subsequent calls to vnc_connection_read*() to use the compressed data */
     priv->uncompressed_offset = 0;
     priv->uncompressed_size = 0;
@@ -2551,7 +4327,9 @@ static void vnc_connection_zrle_update(VncConnection *conn,
     priv->compressed_length = 0;
     priv->compressed_buffer = NULL;
 
-    g_free(zlib_data);
+    vnc_connection_scratch_free(conn, zlib_data);
+
+    return TRUE;
 }
 
 static guint32 vnc_connection_read_cint(VncConnection *conn)
@@ -2584,16 +4362,20 @@ static int vnc_connection_tpixel_size(VncConnection *conn)
     return priv->fmt.bits_per_pixel / 8;
 }
 
-static void vnc_connection_read_tpixel(VncConnection *conn, guint8 *pixel)
+/*
+ * Expand a tpixel, as sent on the wire, to a remote format pixel
+ */
+static void vnc_connection_load_tpixel(VncConnection *conn,
+                                       const guint8 *tpixel,
+                                       guint8 *pixel)
 {
     VncConnectionPrivate *priv = conn->priv;
 
     if (priv->fmt.depth == 24) {
         guint32 val;
-        vnc_connection_read(conn, pixel, 3);
-        val = (pixel[0] << priv->fmt.red_shift)
-            | (pixel[1] << priv->fmt.green_shift)
-            | (pixel[2] << priv->fmt.blue_shift);
+        val = (tpixel[0] << priv->fmt.red_shift)
+            | (tpixel[1] << priv->fmt.green_shift)
+            | (tpixel[2] << priv->fmt.blue_shift);
 
         if (priv->fmt.byte_order != G_BYTE_ORDER)
             val =   (((val >>  0) & 0xFF) << 24) |
@@ -2602,6 +4384,18 @@ static void vnc_connection_read_tpixel(VncConnection *conn, guint8 *pixel)
                 (((val >> 24) & 0xFF) << 0);
 
         memcpy(pixel, &val, 4);
+    } else
+        memcpy(pixel, tpixel, vnc_connection_pixel_size(conn));
+}
+
+static void vnc_connection_read_tpixel(VncConnection *conn, guint8 *pixel)
+{
+    VncConnectionPrivate *priv = conn->priv;
+
+    if (priv->fmt.depth == 24) {
+        guint8 tpixel[3];
+        vnc_connection_read(conn, tpixel, 3);
+        vnc_connection_load_tpixel(conn, tpixel, pixel);
     } else
         vnc_connection_read_pixel(conn, pixel);
 }
@@ -2611,27 +4405,32 @@ static void vnc_connection_tight_update_copy(VncConnection *conn,
                                              guint16 width, guint16 height)
 {
     VncConnectionPrivate *priv = conn->priv;
-    guint8 pixel[4];
+    int bpp = vnc_connection_pixel_size(conn);
+    int tbpp = vnc_connection_tpixel_size(conn);
+    guint8 *tpixels, *row;
     int i, j;
 
+    /* A row at a time, so the framebuffer is locked and
+     * damaged once per row rather than once per pixel */
+    tpixels = vnc_connection_scratch_alloc(conn, width * tbpp);
+    row = tbpp == bpp ? tpixels : vnc_connection_scratch_alloc(conn, width * bpp);
+
     for (j = 0; j < height; j++) {
-        for (i = 0; i < width; i++) {
-            vnc_connection_read_tpixel(conn, pixel);
-            vnc_framebuffer_set_pixel_at(priv->fb, pixel, x + i, y + j);
+        if (vnc_connection_read(conn, tpixels, width * tbpp) < 0)
+            break;
+
+        if (row != tpixels) {
+            for (i = 0; i < width; i++)
+                vnc_connection_load_tpixel(conn, tpixels + (i * tbpp),
+                                           row + (i * bpp));
         }
-    }
-}
 
-static int vnc_connection_tight_get_pi(VncConnection *conn, guint8 *ra,
-                                       int i, guint8 palette_size)
-{
-    if (palette_size == 2) {
-        if ((i % 8) == 0)
-            *ra = vnc_connection_read_u8(conn);
-        return (*ra >> (7 - (i % 8))) & 1;
+        vnc_framebuffer_blt(priv->fb, row, width * bpp, x, y + j, width, 1);
     }
 
-    return vnc_connection_read_u8(conn);
+    if (row != tpixels)
+        vnc_connection_scratch_free(conn, row);
+    vnc_connection_scratch_free(conn, tpixels);
 }
 
 static void vnc_connection_tight_update_palette(VncConnection *conn,
@@ -2640,18 +4439,31 @@ static void vnc_connection_tight_update_palette(VncConnection *conn,
                                                 guint16 width, guint16 height)
 {
     VncConnectionPrivate *priv = conn->priv;
-    int i, j;
+    int bpp = vnc_connection_pixel_size(conn);
+    int bits = palette_size == 2 ? 1 : 8;
+    int stride = palette_size == 2 ? (width + 7) / 8 : width;
+    guint8 lut[16 * 4 * 4];
+    guint8 *indexes, *row;
+    int j;
+
+    if (bits == 1)
+        vnc_connection_palette_lut(palette, bpp, lut);
+
+    indexes = vnc_connection_scratch_alloc(conn, stride);
+    row = vnc_connection_scratch_alloc(conn, width * bpp);
 
     for (j = 0; j < height; j++) {
-        guint8 ra = 0;
+        if (vnc_connection_read(conn, indexes, stride) < 0)
+            break;
 
-        for (i = 0; i < width; i++) {
-            guint8 ind;
+        vnc_connection_palette_expand_row(indexes, row, bits, palette, lut,
+                                          bpp, width);
 
-            ind = vnc_connection_tight_get_pi(conn, &ra, i, palette_size);
-            vnc_framebuffer_set_pixel_at(priv->fb, &palette[ind * 4], x + i, y + j);
-        }
+        vnc_framebuffer_blt(priv->fb, row, width * bpp, x, y + j, width, 1);
     }
+
+    vnc_connection_scratch_free(conn, row);
+    vnc_connection_scratch_free(conn, indexes);
 }
 
 static void vnc_connection_tight_compute_predicted(VncConnection *conn, guint8 *ppixel,
@@ -2668,7 +4480,166 @@ static void vnc_connection_tight_sum_pixel(VncConnection *conn,
 {
     VncConnectionPrivate *priv = conn->priv;
 
-    priv->tight_sum_pixel(conn, lhs, rhs);
+    priv->tight_sum_pixel(conn, lhs, rhs);
+}
+
+/*
+ * The gradient filter can be reconstructed a row at a time for
+ * the common formats: 24-bit depth, where tpixels are plain RGB
+ * bytes, and 16 bpp. Other formats take the per-pixel path
+ */
+static gboolean vnc_connection_tight_gradient_by_row(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int bpp = vnc_connection_pixel_size(conn);
+
+    if (priv->fmt.depth == 24)
+        return bpp == 4 &&
+            priv->fmt.red_max == 255 &&
+            priv->fmt.green_max == 255 &&
+            priv->fmt.blue_max == 255;
+
+    return bpp == 2;
+}
+
+/*
+ * Reconstruct one row of gradient filtered data. 'src' holds the
+ * row's tpixels as sent on the wire, and 'dst' receives them as
+ * remote format pixels. 'state' is scratch space of 9 * width
+ * components, which must be zeroed before the first row and
+ * then carries the previous row between calls.
+ *
+ * Only the left neighbour forms a serial dependency, so the
+ * unpacking, vertical gradient and packing are kept in simple
+ * loops over the whole row which the compiler can vectorize
+ */
+static void vnc_connection_tight_gradient_row(VncConnection *conn,
+                                              const guint8 *src,
+                                              guint8 *dst,
+                                              guint16 *state,
+                                              guint16 width)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    guint16 *above = state;
+    guint16 *delta = state + (width * 3);
+    gint16 *grad = (gint16 *)(state + (width * 6));
+    int rmax = priv->fmt.red_max;
+    int gmax = priv->fmt.green_max;
+    int bmax = priv->fmt.blue_max;
+    int rs = priv->fmt.red_shift;
+    int gs = priv->fmt.green_shift;
+    int bs = priv->fmt.blue_shift;
+    int big = priv->fmt.byte_order == G_BIG_ENDIAN;
+    int n = width * 3;
+    int lr = 0, lg = 0, lb = 0;
+    int i;
+
+    /* Unpack the row into r,g,b components */
+    if (priv->fmt.depth == 24) {
+        for (i = 0; i < n; i++)
+            delta[i] = src[i];
+    } else if (big) {
+        for (i = 0; i < width; i++) {
+            guint16 v = (src[i * 2] << 8) | src[(i * 2) + 1];
+            delta[(i * 3) + 0] = (v >> rs) & rmax;
+            delta[(i * 3) + 1] = (v >> gs) & gmax;
+            delta[(i * 3) + 2] = (v >> bs) & bmax;
+        }
+    } else {
+        for (i = 0; i < width; i++) {
+            guint16 v = src[i * 2] | (src[(i * 2) + 1] << 8);
+            delta[(i * 3) + 0] = (v >> rs) & rmax;
+            delta[(i * 3) + 1] = (v >> gs) & gmax;
+            delta[(i * 3) + 2] = (v >> bs) & bmax;
+        }
+    }
+
+    /* Vertical part of the prediction, 'above - above left' */
+    grad[0] = above[0];
+    grad[1] = above[1];
+    grad[2] = above[2];
+    for (i = 3; i < n; i++)
+        grad[i] = above[i] - above[i - 3];
+
+    /* Add in the left neighbour, clamp, and apply the difference,
+     * overwriting the previous row as we go */
+    for (i = 0; i < n; i += 3) {
+        int r = CLAMP(lr + grad[i + 0], 0, rmax);
+        int g = CLAMP(lg + grad[i + 1], 0, gmax);
+        int b = CLAMP(lb + grad[i + 2], 0, bmax);
+
+        lr = above[i + 0] = (r + delta[i + 0]) & rmax;
+        lg = above[i + 1] = (g + delta[i + 1]) & gmax;
+        lb = above[i + 2] = (b + delta[i + 2]) & bmax;
+    }
+
+    /* Pack the components into remote format pixels */
+    if (priv->fmt.depth == 24) {
+        for (i = 0; i < width; i++) {
+            guint32 v = (above[(i * 3) + 0] << rs) |
+                (above[(i * 3) + 1] << gs) |
+                (above[(i * 3) + 2] << bs);
+            if (big) {
+                dst[(i * 4) + 0] = v >> 24;
+                dst[(i * 4) + 1] = v >> 16;
+                dst[(i * 4) + 2] = v >> 8;
+                dst[(i * 4) + 3] = v;
+            } else {
+                dst[(i * 4) + 0] = v;
+                dst[(i * 4) + 1] = v >> 8;
+                dst[(i * 4) + 2] = v >> 16;
+                dst[(i * 4) + 3] = v >> 24;
+            }
+        }
+    } else {
+        for (i = 0; i < width; i++) {
+            guint16 v = (above[(i * 3) + 0] << rs) |
+                (above[(i * 3) + 1] << gs) |
+                (above[(i * 3) + 2] << bs);
+            if (big) {
+                dst[(i * 2) + 0] = v >> 8;
+                dst[(i * 2) + 1] = v;
+            } else {
+                dst[(i * 2) + 0] = v;
+                dst[(i * 2) + 1] = v >> 8;
+            }
+        }
+    }
+}
+
+/*
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_tight_update_gradient_rows(VncConnection *conn,
+                                                      guint16 x, guint16 y,
+                                                      guint16 width, guint16 height)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int bpp = vnc_connection_pixel_size(conn);
+    int tbpp = vnc_connection_tpixel_size(conn);
+    guint16 *state;
+    guint8 *wire, *row;
+    int j;
+
+    state = vnc_connection_scratch_alloc(conn, width * 9 * sizeof(guint16));
+    wire = vnc_connection_scratch_alloc(conn, width * tbpp);
+    row = vnc_connection_scratch_alloc(conn, width * bpp);
+
+    memset(state, 0, width * 9 * sizeof(guint16));
+
+    for (j = 0; j < height; j++) {
+        /* read a whole row of differences off the wire at once */
+        if (vnc_connection_read(conn, wire, width * tbpp) < 0)
+            break;
+
+        vnc_connection_tight_gradient_row(conn, wire, row, state, width);
+
+        vnc_framebuffer_blt(priv->fb, row, width * bpp, x, y + j, width, 1);
+    }
+
+    vnc_connection_scratch_free(conn, row);
+    vnc_connection_scratch_free(conn, wire);
+    vnc_connection_scratch_free(conn, state);
 }
 
 static void vnc_connection_tight_update_gradient(VncConnection *conn,
@@ -2681,9 +4652,14 @@ static void vnc_connection_tight_update_gradient(VncConnection *conn,
     int bpp;
     VncConnectionPrivate *priv = conn->priv;
 
+    if (vnc_connection_tight_gradient_by_row(conn)) {
+        vnc_connection_tight_update_gradient_rows(conn, x, y, width, height);
+        return;
+    }
+
     bpp = vnc_connection_pixel_size(conn);
-    last_row = g_malloc(width * bpp);
-    row = g_malloc(width * bpp);
+    last_row = vnc_connection_scratch_alloc(conn, width * bpp);
+    row = vnc_connection_scratch_alloc(conn, width * bpp);
 
     memset(last_row, 0, width * bpp);
     memset(zero_pixel, 0, 4);
@@ -2725,8 +4701,10 @@ static void vnc_connection_tight_update_gradient(VncConnection *conn,
         row = tmp_row;
     }
 
-    g_free(row);
-    g_free(last_row);
+    /* the rows may have been swapped, but the arena copes
+     * with either order when both are released */
+    vnc_connection_scratch_free(conn, row);
+    vnc_connection_scratch_free(conn, last_row);
 }
 
 
@@ -2756,9 +4734,310 @@ static void vnc_connection_tight_update_jpeg(VncConnection *conn, guint16 x, gui
     g_object_unref(p);
 }
 
-static void vnc_connection_tight_update(VncConnection *conn,
-                                        guint16 x, guint16 y,
-                                        guint16 width, guint16 height)
+/*
+ * Inflate exactly 'outlen' bytes from a self contained block
+ * of compressed data. Safe to call from any thread, provided
+ * it has exclusive use of 'strm'
+ */
+static gboolean vnc_connection_inflate_all(z_stream *strm,
+                                           guint8 *in, size_t inlen,
+                                           guint8 *out, size_t outlen)
+{
+    strm->next_in = in;
+    strm->avail_in = inlen;
+    strm->next_out = out;
+    strm->avail_out = outlen;
+
+    while (strm->avail_out) {
+        if (inflate(strm, Z_SYNC_FLUSH) != Z_OK)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * The tight_decode_* functions turn an already decompressed
+ * block of filtered tpixel data into a width * height array of
+ * remote format pixels. They only read connection state which
+ * is fixed for the duration of a framebuffer update message, so
+ * may run on a decode worker thread
+ */
+static void vnc_connection_tight_decode_copy(VncConnection *conn,
+                                             const guint8 *data,
+                                             guint8 *pixels,
+                                             guint16 width, guint16 height)
+{
+    int bpp = vnc_connection_pixel_size(conn);
+    int tbpp = vnc_connection_tpixel_size(conn);
+    int i;
+
+    for (i = 0; i < width * height; i++)
+        vnc_connection_load_tpixel(conn, data + (i * tbpp), pixels + (i * bpp));
+}
+
+static void vnc_connection_tight_decode_palette(VncConnection *conn,
+                                                int palette_size, guint8 *palette,
+                                                const guint8 *data,
+                                                guint8 *pixels,
+                                                guint16 width, guint16 height)
+{
+    int bpp = vnc_connection_pixel_size(conn);
+    int bits = palette_size == 2 ? 1 : 8;
+    int stride = palette_size == 2 ? (width + 7) / 8 : width;
+    guint8 lut[16 * 4 * 4];
+    int j;
+
+    if (bits == 1)
+        vnc_connection_palette_lut(palette, bpp, lut);
+
+    for (j = 0; j < height; j++)
+        vnc_connection_palette_expand_row(data + (j * stride),
+                                          pixels + (j * width * bpp),
+                                          bits, palette, lut,
+                                          bpp, width);
+}
+
+static void vnc_connection_tight_decode_gradient(VncConnection *conn,
+                                                 const guint8 *data,
+                                                 guint8 *pixels,
+                                                 guint16 width, guint16 height)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int bpp = vnc_connection_pixel_size(conn);
+    int tbpp = vnc_connection_tpixel_size(conn);
+    guint8 zero_pixel[4];
+    guint8 *zero_row;
+    guint8 *last_row;
+    int i, j;
+
+    if (vnc_connection_tight_gradient_by_row(conn)) {
+        guint16 *state = g_new0(guint16, width * 9);
+
+        for (j = 0; j < height; j++)
+            vnc_connection_tight_gradient_row(conn,
+                                              data + (j * width * tbpp),
+                                              pixels + (j * width * bpp),
+                                              state, width);
+
+        g_free(state);
+        return;
+    }
+
+    zero_row = g_malloc0(width * bpp);
+    memset(zero_pixel, 0, 4);
+    last_row = zero_row;
+
+    for (j = 0; j < height; j++) {
+        guint8 *row = pixels + (j * width * bpp);
+        guint8 *llp, *lp;
+
+        /* use zero pixels for the edge cases */
+        llp = zero_pixel;
+        lp = zero_pixel;
+
+        for (i = 0; i < width; i++) {
+            guint8 predicted_pixel[4];
+
+            priv->tight_compute_predicted(conn, predicted_pixel,
+                                          lp, last_row + i * bpp,
+                                          llp);
+            vnc_connection_load_tpixel(conn, data, row + i * bpp);
+            data += tbpp;
+            priv->tight_sum_pixel(conn, row + i * bpp, predicted_pixel);
+
+            llp = last_row + i * bpp;
+            lp = row + i * bpp;
+        }
+
+        last_row = row;
+    }
+
+    g_free(zero_row);
+}
+
+
+/*
+ * Runs on one of the tight stream workers. Each zlib stream
+ * is bound to a single worker thread, so jobs for a stream are
+ * inflated in the order they were received
+ */
+static void vnc_connection_tight_job_run(gpointer data,
+                                         gpointer opaque G_GNUC_UNUSED)
+{
+    struct decode_job *job = data;
+    VncConnection *conn = job->conn;
+    VncConnectionPrivate *priv = conn->priv;
+
+    if (job->zlib_data) {
+        job->data = g_malloc(job->data_size);
+        if (!vnc_connection_inflate_all(&priv->streams[job->stream + 1],
+                                        job->zlib_data, job->zlib_length,
+                                        job->data, job->data_size)) {
+            vnc_connection_decode_job_complete(job, TRUE);
+            return;
+        }
+        g_free(job->zlib_data);
+        job->zlib_data = NULL;
+    }
+
+    job->pixels = g_malloc(job->rowstride * job->height);
+
+    switch (job->filter_id) {
+    case 0: /* copy */
+        vnc_connection_tight_decode_copy(conn, job->data, job->pixels,
+                                         job->width, job->height);
+        break;
+    case 1: /* palette */
+        vnc_connection_tight_decode_palette(conn, job->palette_size,
+                                            (guint8 *)job->palette,
+                                            job->data, job->pixels,
+                                            job->width, job->height);
+        break;
+    case 2: /* gradient */
+        vnc_connection_tight_decode_gradient(conn, job->data, job->pixels,
+                                             job->width, job->height);
+        break;
+    default:
+        g_warn_if_reached();
+    }
+
+    vnc_connection_decode_job_complete(job, FALSE);
+}
+
+static GThreadPool *vnc_connection_tight_pool(VncConnection *conn, int stream)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int n = MIN(priv->decode_threads, 4);
+
+    stream %= n;
+    if (!priv->tight_pool[stream]) {
+        vnc_connection_threads_init();
+        /* Exactly one thread per pool keeps jobs on
+         * each zlib stream strictly ordered */
+        priv->tight_pool[stream] = g_thread_pool_new(vnc_connection_tight_job_run,
+                                                     conn, 1, FALSE, NULL);
+    }
+
+    return priv->tight_pool[stream];
+}
+
+/*
+ * Read the compressed data for a tight basic rect and hand
+ * it over to the worker owning its zlib stream
+ *
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_tight_queue_basic(VncConnection *conn,
+                                             int stream, guint8 filter_id,
+                                             int palette_size, guint8 *palette,
+                                             guint32 data_size,
+                                             guint16 x, guint16 y,
+                                             guint16 width, guint16 height)
+{
+    struct decode_job *job = g_new0(struct decode_job, 1);
+
+    job->conn = conn;
+    job->commit = VNC_CONNECTION_DECODE_COMMIT_BLT;
+    job->x = x;
+    job->y = y;
+    job->width = width;
+    job->height = height;
+    job->rowstride = width * vnc_connection_pixel_size(conn);
+    job->pending = 1;
+    job->stream = stream;
+    job->filter_id = filter_id;
+    job->palette_size = palette_size;
+    if (palette_size)
+        memcpy(job->palette, palette, palette_size * 4);
+    job->data_size = data_size;
+
+    if (data_size >= 12) {
+        job->zlib_length = vnc_connection_read_cint(conn);
+        job->zlib_data = g_malloc(job->zlib_length);
+        vnc_connection_read(conn, job->zlib_data, job->zlib_length);
+    } else {
+        job->data = g_malloc(data_size);
+        vnc_connection_read(conn, job->data, data_size);
+    }
+
+    if (vnc_connection_has_error(conn)) {
+        vnc_connection_decode_job_free(job);
+        return;
+    }
+
+    vnc_connection_decode_queue(conn, job,
+                                vnc_connection_tight_pool(conn, stream));
+}
+
+/*
+ * Runs on the JPEG pool. JPEG rects carry no zlib state,
+ * so any number may be decoded at once; the ordered commit
+ * takes care of rects which overlap
+ */
+static void vnc_connection_jpeg_job_run(gpointer data,
+                                        gpointer opaque G_GNUC_UNUSED)
+{
+    struct decode_job *job = data;
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    gboolean ok;
+
+    ok = gdk_pixbuf_loader_write(loader, job->data, job->data_size, NULL);
+    ok = gdk_pixbuf_loader_close(loader, NULL) && ok;
+    if (ok && gdk_pixbuf_loader_get_pixbuf(loader))
+        job->pixbuf = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+    g_object_unref(loader);
+
+    g_free(job->data);
+    job->data = NULL;
+
+    if (!job->pixbuf)
+        job->error = "Unable to decode jpeg data";
+    vnc_connection_decode_job_complete(job, job->pixbuf == NULL);
+}
+
+/*
+ * Hand a JPEG rect over to the JPEG pool, taking ownership
+ * of 'data'
+ *
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_tight_queue_jpeg(VncConnection *conn,
+                                            guint8 *data, size_t length,
+                                            guint16 x, guint16 y,
+                                            guint16 width, guint16 height)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    struct decode_job *job = g_new0(struct decode_job, 1);
+
+    job->conn = conn;
+    job->commit = VNC_CONNECTION_DECODE_COMMIT_RGB24;
+    job->x = x;
+    job->y = y;
+    job->width = width;
+    job->height = height;
+    job->pending = 1;
+    job->data = data;
+    job->data_size = length;
+
+    if (!priv->jpeg_pool) {
+        vnc_connection_threads_init();
+        priv->jpeg_pool = g_thread_pool_new(vnc_connection_jpeg_job_run,
+                                            NULL, priv->decode_threads,
+                                            FALSE, NULL);
+    }
+
+    vnc_connection_decode_queue(conn, job, priv->jpeg_pool);
+}
+
+/*
+ * Returns TRUE if the rect has been written to the
+ * framebuffer, or FALSE if it was queued for the
+ * decode workers and will be committed later
+ */
+static gboolean vnc_connection_tight_update(VncConnection *conn,
+                                            guint16 x, guint16 y,
+                                            guint16 width, guint16 height)
 {
     VncConnectionPrivate *priv = conn->priv;
     guint8 ccontrol;
@@ -2767,6 +5046,11 @@ static void vnc_connection_tight_update(VncConnection *conn,
 
     ccontrol = vnc_connection_read_u8(conn);
 
+    /* Stream resets must not overtake data still queued
+     * for the workers on those streams */
+    if (priv->decode_threads && (ccontrol & 0x0F))
+        vnc_connection_decode_flush(conn);
+
     for (i = 0; i < 4; i++) {
         if (ccontrol & (1 << i)) {
             inflateEnd(&priv->streams[i + 1]);
@@ -2791,10 +5075,15 @@ static void vnc_connection_tight_update(VncConnection *conn,
         priv->strm = &priv->streams[(ccontrol & 0x03) + 1];
 
         if (filter_id == 1) {
+            guint8 tpixels[256 * 4];
+            int tbpp = vnc_connection_tpixel_size(conn);
+
             palette_size = vnc_connection_read_u8(conn);
             palette_size += 1;
+            vnc_connection_read(conn, tpixels, palette_size * tbpp);
             for (i = 0; i < palette_size; i++)
-                vnc_connection_read_tpixel(conn, palette[i]);
+                vnc_connection_load_tpixel(conn, tpixels + (i * tbpp),
+                                           palette[i]);
         }
 
         if (filter_id == 1) {
@@ -2805,9 +5094,17 @@ static void vnc_connection_tight_update(VncConnection *conn,
         } else
             data_size = width * height * vnc_connection_tpixel_size(conn);
 
+        if (priv->decode_threads && filter_id <= 2) {
+            priv->strm = NULL;
+            vnc_connection_tight_queue_basic(conn, ccontrol & 0x03, filter_id,
+                                             palette_size, (guint8 *)palette,
+                                             data_size, x, y, width, height);
+            return FALSE;
+        }
+
         if (data_size >= 12) {
             zlib_length = vnc_connection_read_cint(conn);
-            zlib_data = g_malloc(zlib_length);
+            zlib_data = vnc_connection_scratch_alloc(conn, zlib_length);
 
             vnc_connection_read(conn, zlib_data, zlib_length);
 
@@ -2841,7 +5138,7 @@ static void vnc_connection_tight_update(VncConnection *conn,
             priv->compressed_length = 0;
             priv->compressed_buffer = NULL;
 
-            g_free(zlib_data);
+            vnc_connection_scratch_free(conn, zlib_data);
         }
 
         priv->strm = NULL;
@@ -2849,6 +5146,22 @@ static void vnc_connection_tight_update(VncConnection *conn,
         /* fill */
         /* FIXME check each width; endianness */
         vnc_connection_read_tpixel(conn, pixel);
+        if (priv->decode_threads) {
+            struct decode_job *job = g_new0(struct decode_job, 1);
+
+            /* Nothing to decode, but it must still be
+             * ordered against rects already queued */
+            job->conn = conn;
+            job->commit = VNC_CONNECTION_DECODE_COMMIT_FILL;
+            job->x = x;
+            job->y = y;
+            job->width = width;
+            job->height = height;
+            memcpy(job->fill, pixel, sizeof(pixel));
+            job->done = TRUE;
+            vnc_connection_decode_queue(conn, job, NULL);
+            return FALSE;
+        }
         vnc_framebuffer_fill(priv->fb, pixel, x, y, width, height);
     } else if (ccontrol == 9) {
         /* jpeg */
@@ -2856,15 +5169,31 @@ static void vnc_connection_tight_update(VncConnection *conn,
         guint8 *jpeg_data;
 
         length = vnc_connection_read_cint(conn);
-        jpeg_data = g_malloc(length);
+
+        if (priv->decode_threads) {
+            /* the worker takes ownership, so this can't be scratch */
+            jpeg_data = g_malloc(length);
+            vnc_connection_read(conn, jpeg_data, length);
+            if (vnc_connection_has_error(conn)) {
+                g_free(jpeg_data);
+                return FALSE;
+            }
+            vnc_connection_tight_queue_jpeg(conn, jpeg_data, length,
+                                            x, y, width, height);
+            return FALSE;
+        }
+
+        jpeg_data = vnc_connection_scratch_alloc(conn, length);
         vnc_connection_read(conn, jpeg_data, length);
         vnc_connection_tight_update_jpeg(conn, x, y, width, height,
                                          jpeg_data, length);
-        g_free(jpeg_data);
+        vnc_connection_scratch_free(conn, jpeg_data);
     } else {
         vnc_connection_set_error(conn, "Unexpected tight ccontrol %d",
                                  ccontrol);
     }
+
+    return TRUE;
 }
 
 static void vnc_connection_update(VncConnection *conn, int x, int y, int width, int height)
@@ -2881,7 +5210,61 @@ static void vnc_connection_update(VncConnection *conn, int x, int y, int width,
     sigdata.params.area.y = y;
     sigdata.params.area.width = width;
     sigdata.params.area.height = height;
-    vnc_connection_emit_main_context(conn, VNC_FRAMEBUFFER_UPDATE, &sigdata);
+    vnc_connection_emit_async(conn, VNC_FRAMEBUFFER_UPDATE, &sigdata);
+}
+
+
+/*
+ * Wait for the decode workers, committing their results to
+ * the framebuffer in the order the rects were received, and
+ * signal the update for each rect
+ *
+ * Must only be called from the VNC coroutine
+ */
+static void vnc_connection_decode_flush(VncConnection *conn)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    struct decode_job *job;
+
+    while ((job = g_queue_peek_head(&priv->decode_pending))) {
+        g_condition_wait(vnc_connection_decode_job_is_done, job);
+
+        /* Jobs still in flight are reaped when closing */
+        if (priv->coroutine_stop)
+            return;
+
+        g_queue_pop_head(&priv->decode_pending);
+
+        if (job->failed) {
+            vnc_connection_set_error(conn, "%s",
+                                     job->error ? job->error :
+                                     "Failure decompressing data");
+            vnc_connection_decode_job_free(job);
+            return;
+        }
+
+        switch (job->commit) {
+        case VNC_CONNECTION_DECODE_COMMIT_BLT:
+            vnc_framebuffer_blt(priv->fb, job->pixels, job->rowstride,
+                                job->x, job->y, job->width, job->height);
+            break;
+        case VNC_CONNECTION_DECODE_COMMIT_FILL:
+            vnc_framebuffer_fill(priv->fb, job->fill,
+                                 job->x, job->y, job->width, job->height);
+            break;
+        case VNC_CONNECTION_DECODE_COMMIT_RGB24:
+            vnc_framebuffer_rgb24_blt(priv->fb,
+                                      gdk_pixbuf_get_pixels(job->pixbuf),
+                                      gdk_pixbuf_get_rowstride(job->pixbuf),
+                                      job->x, job->y, job->width, job->height);
+            break;
+        default:
+            g_warn_if_reached();
+        }
+
+        vnc_connection_update(conn, job->x, job->y, job->width, job->height);
+        vnc_connection_decode_job_free(job);
+    }
 }
 
 
@@ -2895,7 +5278,7 @@ static void vnc_connection_bell(VncConnection *conn)
 
     VNC_DEBUG("Server beep");
 
-    vnc_connection_emit_main_context(conn, VNC_BELL, &sigdata);
+    vnc_connection_emit_async(conn, VNC_BELL, &sigdata);
 }
 
 static void vnc_connection_server_cut_text(VncConnection *conn,
@@ -2912,7 +5295,7 @@ static void vnc_connection_server_cut_text(VncConnection *conn,
     text = g_string_new_len ((const gchar *)data, len);
     sigdata.params.text = text->str;
 
-    vnc_connection_emit_main_context(conn, VNC_SERVER_CUT_TEXT, &sigdata);
+    vnc_connection_emit_async(conn, VNC_SERVER_CUT_TEXT, &sigdata);
 
     g_string_free(text, TRUE);
 }
@@ -2925,6 +5308,11 @@ static void vnc_connection_resize(VncConnection *conn, int width, int height)
     if (priv->coroutine_stop)
         return;
 
+#ifdef HAVE_GIOUNIX
+    /* The server shares a new area for the new size */
+    vnc_connection_shm_release(conn);
+#endif
+
     priv->width = width;
     priv->height = height;
 
@@ -2960,7 +5348,7 @@ static void vnc_connection_pointer_type_change(VncConnection *conn, gboolean abs
         return;
 
     sigdata.params.absPointer = absPointer;
-    vnc_connection_emit_main_context(conn, VNC_POINTER_MODE_CHANGED, &sigdata);
+    vnc_connection_emit_async(conn, VNC_POINTER_MODE_CHANGED, &sigdata);
 }
 
 static void vnc_connection_rich_cursor_blt(VncConnection *conn, guint8 *pixbuf,
@@ -3012,7 +5400,7 @@ static void vnc_connection_rich_cursor(VncConnection *conn, int x, int y, int wi
 
     sigdata.params.cursor = priv->cursor;
 
-    vnc_connection_emit_main_context(conn, VNC_CURSOR_CHANGED, &sigdata);
+    vnc_connection_emit_async(conn, VNC_CURSOR_CHANGED, &sigdata);
 }
 
 static void vnc_connection_xcursor(VncConnection *conn, int x, int y, int width, int height)
@@ -3067,7 +5455,7 @@ static void vnc_connection_xcursor(VncConnection *conn, int x, int y, int width,
 
     sigdata.params.cursor = priv->cursor;
 
-    vnc_connection_emit_main_context(conn, VNC_CURSOR_CHANGED, &sigdata);
+    vnc_connection_emit_async(conn, VNC_CURSOR_CHANGED, &sigdata);
 }
 
 static void vnc_connection_ext_key_event(VncConnection *conn)
@@ -3107,6 +5495,12 @@ static gboolean vnc_connection_framebuffer_update(VncConnection *conn, gint32 et
     if (vnc_connection_has_error(conn))
         return !vnc_connection_has_error(conn);
 
+    /* Anything other than tight & ZRLE may depend on, or
+     * overwrite, rects still with the decode workers */
+    if (etype != VNC_CONNECTION_ENCODING_TIGHT &&
+        etype != VNC_CONNECTION_ENCODING_ZRLE)
+        vnc_connection_decode_flush(conn);
+
     switch (etype) {
     case VNC_CONNECTION_ENCODING_RAW:
         if (!vnc_connection_validate_boundary(conn, x, y, width, height))
@@ -3135,14 +5529,14 @@ static gboolean vnc_connection_framebuffer_update(VncConnection *conn, gint32 et
     case VNC_CONNECTION_ENCODING_ZRLE:
         if (!vnc_connection_validate_boundary(conn, x, y, width, height))
             break;
-        vnc_connection_zrle_update(conn, x, y, width, height);
-        vnc_connection_update(conn, x, y, width, height);
+        if (vnc_connection_zrle_update(conn, x, y, width, height))
+            vnc_connection_update(conn, x, y, width, height);
         break;
     case VNC_CONNECTION_ENCODING_TIGHT:
         if (!vnc_connection_validate_boundary(conn, x, y, width, height))
             break;
-        vnc_connection_tight_update(conn, x, y, width, height);
-        vnc_connection_update(conn, x, y, width, height);
+        if (vnc_connection_tight_update(conn, x, y, width, height))
+            vnc_connection_update(conn, x, y, width, height);
         break;
     case VNC_CONNECTION_ENCODING_DESKTOP_RESIZE:
         vnc_connection_resize(conn, width, height);
@@ -3156,6 +5550,9 @@ static gboolean vnc_connection_framebuffer_update(VncConnection *conn, gint32 et
         vnc_connection_resend_framebuffer_update_request(conn);
         break;
     case VNC_CONNECTION_ENCODING_WMVi:
+#ifdef HAVE_GIOUNIX
+        vnc_connection_shm_release(conn);
+#endif
         vnc_connection_read_pixel_format(conn, &priv->fmt);
         vnc_connection_pixel_format(conn);
         break;
@@ -3171,6 +5568,17 @@ static gboolean vnc_connection_framebuffer_update(VncConnection *conn, gint32 et
         vnc_connection_ext_key_event(conn);
         vnc_connection_resend_framebuffer_update_request(conn);
         break;
+#ifdef HAVE_GIOUNIX
+    case VNC_CONNECTION_ENCODING_SHARED_MEMORY:
+        vnc_connection_shm_setup(conn, width, height);
+        break;
+    case VNC_CONNECTION_ENCODING_SHARED_DAMAGE:
+        if (!vnc_connection_validate_boundary(conn, x, y, width, height))
+            break;
+        if (vnc_connection_shm_damage(conn, x, y, width, height))
+            vnc_connection_update(conn, x, y, width, height);
+        break;
+#endif
     case VNC_CONNECTION_ENCODING_AUDIO:
         VNC_DEBUG("Audio encoding support");
         priv->has_audio=TRUE;
@@ -3200,6 +5608,9 @@ static gboolean vnc_connection_audio_timer(gpointer opaque)
     if (!priv->audio_sample)
         return FALSE;
 
+    /* Play any queued samples before this one */
+    vnc_connection_dispatch_events(conn);
+
     VNC_DEBUG("Audio tick %u\n", priv->audio_sample->length);
 
     if (priv->audio)
@@ -3211,62 +5622,27 @@ static gboolean vnc_connection_audio_timer(gpointer opaque)
 }
 
 
-struct audio_action_data
-{
-    VncConnection *conn;
-    struct coroutine *caller;
-    enum {
-        VNC_AUDIO_PLAYBACK_STOP = 0,
-        VNC_AUDIO_PLAYBACK_START = 1,
-        VNC_AUDIO_PLAYBACK_DATA = 2,
-    } action;
-};
-
-static gboolean do_vnc_connection_audio_action(gpointer opaque)
-{
-    struct audio_action_data *data = opaque;
-    VncConnectionPrivate *priv = data->conn->priv;
-
-    VNC_DEBUG("Audio action main context %u", data->action);
-
-    switch (data->action) {
-    case VNC_AUDIO_PLAYBACK_STOP:
-        vnc_audio_playback_stop(priv->audio);
-        break;
-    case VNC_AUDIO_PLAYBACK_START:
-        vnc_audio_playback_start(priv->audio, &priv->audio_format);
-        break;
-    case VNC_AUDIO_PLAYBACK_DATA:
-        vnc_audio_playback_data(priv->audio, priv->audio_sample);
-        break;
-    default:
-        g_warn_if_reached();
-    }
-
-    coroutine_yieldto(data->caller, NULL);
-    return FALSE;
-}
-
+/*
+ * Queue an audio action for the main context. A sample
+ * being played is handed over along with the action
+ */
 static void vnc_connection_audio_action(VncConnection *conn,
                                         int action)
 {
-    struct audio_action_data data = {
-        conn,
-        coroutine_self(),
-        action,
-    };
+    VncConnectionPrivate *priv = conn->priv;
+    struct signal_event *ev = g_new0(struct signal_event, 1);
 
     VNC_DEBUG("Emit audio action %d\n", action);
 
-    g_idle_add(do_vnc_connection_audio_action, &data);
+    ev->audio = TRUE;
+    ev->action = action;
+    ev->format = priv->audio_format;
+    if (action == VNC_AUDIO_PLAYBACK_DATA) {
+        ev->sample = priv->audio_sample;
+        priv->audio_sample = NULL;
+    }
 
-    /* This switches to the system coroutine context, lets
-     * the idle function run to dispatch the action, and
-     * finally returns once complete. ie this is synchronous
-     * from the POV of the VNC coroutine despite there being
-     * an idle function involved
-     */
-    coroutine_yield(NULL);
+    vnc_connection_queue_event(conn, ev);
 }
 
 
@@ -3279,6 +5655,8 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
     if (vnc_connection_has_error(conn))
         return !vnc_connection_has_error(conn);
 
+    vnc_connection_scratch_reset(conn);
+
     /* NB: make sure that all server message functions
        handle has_error appropriately */
 
@@ -3316,12 +5694,17 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
             if (!vnc_connection_framebuffer_update(conn, etype, x, y, w, h))
                 break;
         }
+        vnc_connection_decode_flush(conn);
+
+        if (!vnc_connection_has_error(conn) &&
+            VNC_IS_BASE_FRAMEBUFFER(priv->fb))
+            vnc_base_framebuffer_frame_complete(VNC_BASE_FRAMEBUFFER(priv->fb));
     }        break;
     case VNC_CONNECTION_SERVER_MESSAGE_SET_COLOR_MAP_ENTRIES: {
         guint16 first_color;
         guint16 n_colors;
         guint8 pad[1];
-        VncColorMap *map;
+        guint8 *entries;
         int i;
 
         vnc_connection_read(conn, pad, 1);
@@ -3330,22 +5713,36 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
 
         VNC_DEBUG("Colour map from %d with %d entries",
                   first_color, n_colors);
-        map = vnc_color_map_new(first_color, n_colors);
 
-        for (i = 0; i < n_colors; i++) {
-            guint16 red, green, blue;
+        /* The framebuffer takes its own copy, so the map is
+         * kept around for reuse while its range is unchanged */
+        if (priv->color_map &&
+            (priv->color_map->offset != first_color ||
+             priv->color_map->size != n_colors)) {
+            vnc_color_map_free(priv->color_map);
+            priv->color_map = NULL;
+        }
+        if (!priv->color_map)
+            priv->color_map = vnc_color_map_new(first_color, n_colors);
+
+        entries = vnc_connection_scratch_alloc(conn, n_colors * 6);
+        if (vnc_connection_read(conn, entries, n_colors * 6) < 0) {
+            vnc_connection_scratch_free(conn, entries);
+            break;
+        }
 
-            red = vnc_connection_read_u16(conn);
-            green = vnc_connection_read_u16(conn);
-            blue = vnc_connection_read_u16(conn);
+        for (i = 0; i < n_colors; i++) {
+            const guint8 *e = entries + (i * 6);
 
-            vnc_color_map_set(map,
+            vnc_color_map_set(priv->color_map,
                               i + first_color,
-                              red, green, blue);
+                              (e[0] << 8) | e[1],
+                              (e[2] << 8) | e[3],
+                              (e[4] << 8) | e[5]);
         }
+        vnc_connection_scratch_free(conn, entries);
 
-        vnc_framebuffer_set_color_map(priv->fb, map);
-        vnc_color_map_free(map);
+        vnc_framebuffer_set_color_map(priv->fb, priv->color_map);
     }        break;
     case VNC_CONNECTION_SERVER_MESSAGE_BELL:
         vnc_connection_bell(conn);
@@ -3405,8 +5802,6 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
                     ((priv->audio_sample->capacity - priv->audio_sample->length) < n_length)) {
                     g_source_remove(priv->audio_timer);
                     vnc_connection_audio_action(conn, VNC_AUDIO_PLAYBACK_DATA);
-                    vnc_audio_sample_free(priv->audio_sample);
-                    priv->audio_sample = NULL;
                 }
                 if (!priv->audio_sample) {
                     priv->audio_sample = vnc_audio_sample_new(1024*1024);
@@ -3431,8 +5826,6 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
                     if (priv->audio_sample) {
                         g_source_remove(priv->audio_timer);
                         vnc_connection_audio_action(conn, VNC_AUDIO_PLAYBACK_DATA);
-                        vnc_audio_sample_free(priv->audio_sample);
-                        priv->audio_sample = NULL;
                     }
                     vnc_connection_audio_action(conn, VNC_AUDIO_PLAYBACK_STOP);
                 } else {
@@ -4747,6 +7140,10 @@ static void vnc_connection_finalize (GObject *object)
     if (priv->audio_timer)
         g_source_remove(priv->audio_timer);
 
+#ifdef HAVE_GIOUNIX
+    g_mutex_free(priv->shm_lock);
+#endif
+
     G_OBJECT_CLASS(vnc_connection_parent_class)->finalize (object);
 }
 
@@ -4770,6 +7167,17 @@ static void vnc_connection_class_init(VncConnectionClass *klass)
                                                         G_PARAM_STATIC_NICK |
                                                         G_PARAM_STATIC_BLURB));
 
+    g_object_class_install_property(object_class,
+                                    PROP_SCRATCH_PEAK,
+                                    g_param_spec_uint64("scratch-peak",
+                                                        "Scratch arena peak",
+                                                        "Largest size reached by the decoder scratch arena, in bytes",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+
     signals[VNC_CURSOR_CHANGED] =
         g_signal_new ("vnc-cursor-changed",
                       G_OBJECT_CLASS_TYPE (object_class),
@@ -4972,8 +7380,13 @@ static void vnc_connection_init(VncConnection *conn)
     memset(priv, 0, sizeof(*priv));
 
     priv->fd = -1;
+    priv->coroutine_stack_size = 16 << 20;
     priv->auth_type = VNC_CONNECTION_AUTH_INVALID;
     priv->auth_subtype = VNC_CONNECTION_AUTH_INVALID;
+#ifdef HAVE_GIOUNIX
+    priv->shm_lock = g_mutex_new();
+    g_queue_init(&priv->shm_fds);
+#endif
 }
 
 
@@ -4998,6 +7411,9 @@ static void vnc_connection_close(VncConnection *conn)
 
     VNC_DEBUG("Close VncConnection=%p", conn);
 
+    vnc_connection_recv_stop(conn);
+    vnc_connection_decode_stop(conn);
+
     if (priv->tls_session) {
         gnutls_bye(priv->tls_session, GNUTLS_SHUT_RDWR);
         priv->tls_session = NULL;
@@ -5043,6 +7459,24 @@ static void vnc_connection_close(VncConnection *conn)
         priv->xmit_buffer_capacity = 0;
     }
 
+    if (priv->scratch) {
+        g_free(priv->scratch);
+        priv->scratch = NULL;
+    }
+    priv->scratch_size = priv->scratch_used = priv->scratch_wanted = 0;
+
+    if (priv->color_map) {
+        vnc_color_map_free(priv->color_map);
+        priv->color_map = NULL;
+    }
+
+#ifdef HAVE_GIOUNIX
+    vnc_connection_shm_release(conn);
+    while (!g_queue_is_empty(&priv->shm_fds))
+        close(GPOINTER_TO_INT(g_queue_pop_head(&priv->shm_fds)));
+    priv->shm_requested = FALSE;
+#endif
+
     priv->read_offset = priv->read_size = 0;
     priv->write_offset = 0;
     priv->uncompressed_offset = 0;
@@ -5117,6 +7551,8 @@ void vnc_connection_shutdown(VncConnection *conn)
 
     priv->fd = -1;
     priv->coroutine_stop = TRUE;
+    if (priv->recv_cancel)
+        g_cancellable_cancel(priv->recv_cancel);
     VNC_DEBUG("Waking up coroutine to shutdown gracefully");
     g_io_wakeup(&priv->wait);
 
@@ -5435,6 +7871,7 @@ static void *vnc_connection_coroutine(void *opaque)
     VncConnectionPrivate *priv = conn->priv;
     int ret;
     struct signal_data s;
+    gsize stack_used;
 
     VNC_DEBUG("Started background coroutine");
 
@@ -5457,12 +7894,19 @@ static void *vnc_connection_coroutine(void *opaque)
 
     vnc_connection_emit_main_context(conn, VNC_INITIALIZED, &s);
 
+    if (priv->recv_threaded)
+        vnc_connection_recv_start(conn);
+
     VNC_DEBUG("Running main loop");
     while ((ret = vnc_connection_server_message(conn)))
         ;
 
  cleanup:
     VNC_DEBUG("Doing final VNC cleanup");
+    if (vnc_util_get_debug() &&
+        (stack_used = coroutine_stack_used(&priv->coroutine)))
+        VNC_DEBUG("Coroutine used %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes of stack",
+                  stack_used, (gsize)priv->coroutine.stack_size);
     vnc_connection_close(conn);
     vnc_connection_emit_main_context(conn, VNC_DISCONNECTED, &s);
     g_idle_add(vnc_connection_delayed_unref, conn);
@@ -5482,7 +7926,7 @@ static gboolean do_vnc_connection_open(gpointer data)
 
     co = &priv->coroutine;
 
-    co->stack_size = 16 << 20;
+    co->stack_size = priv->coroutine_stack_size;
     co->entry = vnc_connection_coroutine;
     co->release = NULL;
 
@@ -122,6 +122,10 @@ typedef enum {
     VNC_CONNECTION_ENCODING_EXT_KEY_EVENT = -258,
     VNC_CONNECTION_ENCODING_AUDIO = -259,
     VNC_CONNECTION_ENCODING_LED_STATE = -261,
+
+    /* Shared memory framebuffer, local UNIX sockets only */
+    VNC_CONNECTION_ENCODING_SHARED_MEMORY = 0x4753484D,
+    VNC_CONNECTION_ENCODING_SHARED_DAMAGE = 0x47534844,
 } VncConnectionEncoding;
 
 typedef enum {
@@ -198,6 +202,15 @@ const VncPixelFormat *vnc_connection_get_pixel_format(VncConnection *conn);
 gboolean vnc_connection_set_shared(VncConnection *conn, gboolean sharedFlag);
 gboolean vnc_connection_get_shared(VncConnection *conn);
 
+gboolean vnc_connection_set_threaded_receive(VncConnection *conn, gboolean threaded);
+gboolean vnc_connection_get_threaded_receive(VncConnection *conn);
+
+gboolean vnc_connection_set_decode_threads(VncConnection *conn, int threads);
+int vnc_connection_get_decode_threads(VncConnection *conn);
+
+gboolean vnc_connection_set_stack_size(VncConnection *conn, gsize size);
+gsize vnc_connection_get_stack_size(VncConnection *conn);
+
 gboolean vnc_connection_has_error(VncConnection *conn);
 
 gboolean vnc_connection_set_framebuffer(VncConnection *conn,
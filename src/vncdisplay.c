@@ -29,6 +29,7 @@
 #include "vncdisplaykeymap.h"
 #include "vncdisplayenums.h"
 #include "vnccairoframebuffer.h"
+#include "vncthumbnailframebuffer.h"
 
 #include <gtk/gtk.h>
 #include <glib/gi18n.h>
@@ -40,6 +41,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(HAVE_EPOXY) && GTK_CHECK_VERSION(3, 16, 0)
+#define VNC_DISPLAY_GL
+#include <epoxy/gl.h>
+#endif
+
 #ifdef G_OS_WIN32
 #include <windows.h>
 #include <gdk/gdkwin32.h>
@@ -58,7 +64,9 @@ struct _VncDisplayPrivate
 
     VncConnection *conn;
     VncCairoFramebuffer *fb;
+    VncThumbnailFramebuffer *thumb; /* Replaces fb in thumbnail mode */
     cairo_surface_t *fbCache; /* Cache on server display */
+    cairo_surface_t *fbScaled; /* Desktop pre-scaled to the widget size */
 
     VncDisplayDepthColor depth;
 
@@ -82,6 +90,47 @@ struct _VncDisplayPrivate
     gboolean allow_scaling;
     gboolean shared_flag;
     gboolean force_size;
+    gboolean direct_render;
+    gboolean gl_render;
+    guint thumbnail_scale;
+
+    /* Updates are only requested while the desktop can be seen */
+    gboolean mapped;
+    gboolean obscured;
+    gboolean iconified;
+    gboolean visible;
+    gboolean update_deferred;
+
+    /* Frame rate caps for update requests, 0 for none */
+    guint max_fps;
+    guint background_fps;
+    GTimer *update_clock; /* Since the last update request */
+    guint update_timer;
+
+#if GTK_CHECK_VERSION(3, 0, 0)
+    /* Area of the desktop updates were last requested for */
+    cairo_rectangle_int_t roi;
+#endif
+
+#ifdef VNC_DISPLAY_GL
+    GdkGLContext *gl_context;
+    gboolean gl_failed;
+    GLuint gl_fbo[2]; /* Read and draw framebuffers for the blit */
+    GLuint gl_texture; /* Remote desktop, top row first */
+    GLuint gl_target; /* Desktop as drawn, bottom row first */
+    int gl_width, gl_height; /* Size of gl_texture */
+    int gl_target_width, gl_target_height;
+    cairo_region_t *gl_upload; /* Updates not yet in gl_texture */
+    gboolean gl_redraw;
+#endif
+
+#if GTK_CHECK_VERSION(3, 8, 0)
+    /* Damage in widget coordinates, flushed on the next frame
+     * clock tick along with the next update request */
+    cairo_region_t *damage;
+    guint tick_id;
+    gboolean update_pending;
+#endif
 
     GSList *preferable_auths;
     GSList *preferable_vencrypt_subauths;
@@ -117,6 +166,11 @@ enum
     PROP_DEPTH,
     PROP_GRAB_KEYS,
     PROP_CONNECTION,
+    PROP_DIRECT_RENDER,
+    PROP_GL_RENDER,
+    PROP_MAX_FPS,
+    PROP_BACKGROUND_FPS,
+    PROP_THUMBNAIL_SCALE,
 };
 
 /* Signals */
@@ -234,6 +288,21 @@ vnc_display_get_property (GObject    *object,
         case PROP_CONNECTION:
             g_value_set_object(value, vnc->priv->conn);
             break;
+        case PROP_DIRECT_RENDER:
+            g_value_set_boolean (value, vnc->priv->direct_render);
+            break;
+        case PROP_GL_RENDER:
+            g_value_set_boolean (value, vnc->priv->gl_render);
+            break;
+        case PROP_MAX_FPS:
+            g_value_set_uint (value, vnc->priv->max_fps);
+            break;
+        case PROP_BACKGROUND_FPS:
+            g_value_set_uint (value, vnc->priv->background_fps);
+            break;
+        case PROP_THUMBNAIL_SCALE:
+            g_value_set_uint (value, vnc->priv->thumbnail_scale);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -280,6 +349,21 @@ vnc_display_set_property (GObject      *object,
         case PROP_GRAB_KEYS:
             vnc_display_set_grab_keys(vnc, g_value_get_boxed(value));
             break;
+        case PROP_DIRECT_RENDER:
+            vnc_display_set_direct_render (vnc, g_value_get_boolean (value));
+            break;
+        case PROP_GL_RENDER:
+            vnc_display_set_gl_render (vnc, g_value_get_boolean (value));
+            break;
+        case PROP_MAX_FPS:
+            vnc_display_set_max_fps (vnc, g_value_get_uint (value));
+            break;
+        case PROP_BACKGROUND_FPS:
+            vnc_display_set_background_fps (vnc, g_value_get_uint (value));
+            break;
+        case PROP_THUMBNAIL_SCALE:
+            vnc_display_set_thumbnail_scale (vnc, g_value_get_uint (value));
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -348,6 +432,110 @@ static LRESULT CALLBACK keyboard_hook_cb(int code, WPARAM wparam, LPARAM lparam)
 }
 #endif
 
+#if GTK_CHECK_VERSION(3, 0, 0)
+/*
+ * Find the bounding box of the part of the desktop which
+ * is visible on screen, taking into account scrolled
+ * windows or other containers clipping the widget
+ */
+static void visible_desktop_rect(VncDisplay *obj, cairo_rectangle_int_t *rect)
+{
+    VncDisplayPrivate *priv = obj->priv;
+    GdkWindow *window = gtk_widget_get_window(GTK_WIDGET(obj));
+    int fbw = vnc_connection_get_width(priv->conn);
+    int fbh = vnc_connection_get_height(priv->conn);
+    cairo_region_t *region;
+    cairo_rectangle_int_t ext;
+    int ww, wh;
+    int x0, y0, x1, y1;
+
+    rect->x = rect->y = 0;
+    rect->width = fbw;
+    rect->height = fbh;
+
+    /* Thumbnails are small enough to always ask for all of it */
+    if (!window || fbw <= 0 || fbh <= 0 || priv->thumb)
+        return;
+
+    region = gdk_window_get_visible_region(window);
+    cairo_region_get_extents(region, &ext);
+    cairo_region_destroy(region);
+
+    gdk_drawable_get_size(window, &ww, &wh);
+    if (ww <= 0 || wh <= 0)
+        return;
+
+    if (priv->allow_scaling) {
+        x0 = (int)(((gint64)ext.x * fbw) / ww);
+        y0 = (int)(((gint64)ext.y * fbh) / wh);
+        x1 = (int)(((gint64)(ext.x + ext.width) * fbw + ww - 1) / ww);
+        y1 = (int)(((gint64)(ext.y + ext.height) * fbh + wh - 1) / wh);
+    } else {
+        int mx = 0, my = 0;
+
+        if (ww > fbw)
+            mx = (ww - fbw) / 2;
+        if (wh > fbh)
+            my = (wh - fbh) / 2;
+
+        x0 = ext.x - mx;
+        y0 = ext.y - my;
+        x1 = ext.x + ext.width - mx;
+        y1 = ext.y + ext.height - my;
+    }
+
+    x0 = CLAMP(x0, 0, fbw);
+    y0 = CLAMP(y0, 0, fbh);
+    x1 = CLAMP(x1, 0, fbw);
+    y1 = CLAMP(y1, 0, fbh);
+
+    /* Nothing of the desktop on screen, keep asking
+     * for all of it rather than stalling */
+    if (x1 <= x0 || y1 <= y0)
+        return;
+
+    rect->x = x0;
+    rect->y = y0;
+    rect->width = x1 - x0;
+    rect->height = y1 - y0;
+}
+
+/*
+ * Move the region of interest to 'roi'. The server may
+ * not have told us about changes outside the old one, so
+ * any newly exposed area gets a full refresh
+ */
+static void update_region_of_interest(VncDisplay *obj,
+                                      const cairo_rectangle_int_t *roi)
+{
+    VncDisplayPrivate *priv = obj->priv;
+    cairo_region_t *exposed;
+    int i, n;
+
+    if (roi->x == priv->roi.x && roi->y == priv->roi.y &&
+        roi->width == priv->roi.width && roi->height == priv->roi.height)
+        return;
+
+    exposed = cairo_region_create_rectangle(roi);
+    cairo_region_subtract_rectangle(exposed, &priv->roi);
+
+    n = cairo_region_num_rectangles(exposed);
+    for (i = 0; i < n; i++) {
+        cairo_rectangle_int_t rect;
+
+        cairo_region_get_rectangle(exposed, i, &rect);
+        VNC_DEBUG("Refreshing exposed area %dx%d at %d,%d",
+                  rect.width, rect.height, rect.x, rect.y);
+        vnc_connection_framebuffer_update_request(priv->conn, 0,
+                                                  rect.x, rect.y,
+                                                  rect.width, rect.height);
+    }
+
+    cairo_region_destroy(exposed);
+    priv->roi = *roi;
+}
+#endif
+
 static void setup_surface_cache(VncDisplay *dpy, cairo_t *crWin, int w, int h)
 {
     VncDisplayPrivate *priv = dpy->priv;
@@ -373,6 +561,324 @@ static void setup_surface_cache(VncDisplay *dpy, cairo_t *crWin, int w, int h)
     cairo_destroy(crCache);
 }
 
+/*
+ * Map a rectangle of the remote desktop to the area of the
+ * scaled surface it affects, widened by the reach of the
+ * filter kernel so the neighbouring samples are redone too
+ */
+static void scaled_surface_rect(VncDisplay *dpy,
+                                int ww, int wh,
+                                int *x, int *y, int *w, int *h)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+    int fbw = vnc_framebuffer_get_width(VNC_FRAMEBUFFER(priv->fb));
+    int fbh = vnc_framebuffer_get_height(VNC_FRAMEBUFFER(priv->fb));
+    double sx = (double)ww / (double)fbw;
+    double sy = (double)wh / (double)fbh;
+    /* All values are positive, so truncating rounds down. The
+     * margin covers both rounding the far edge up and the
+     * reach of the filter kernel */
+    int mx = (int)sx + 2;
+    int my = (int)sy + 2;
+    int x0 = (int)(*x * sx) - mx;
+    int y0 = (int)(*y * sy) - my;
+    int x1 = (int)((*x + *w) * sx) + mx;
+    int y1 = (int)((*y + *h) * sy) + my;
+
+    *x = MAX(x0, 0);
+    *y = MAX(y0, 0);
+    *w = MIN(x1, ww) - *x;
+    *h = MIN(y1, wh) - *y;
+}
+
+/*
+ * Resample an area of the scaled surface from the
+ * desktop, with 'x', 'y', 'w', 'h' in widget coordinates
+ */
+static void render_scaled_surface(VncDisplay *dpy,
+                                  int x, int y, int w, int h)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+    cairo_surface_t *surface = vnc_cairo_framebuffer_get_surface(priv->fb);
+    int ww = cairo_image_surface_get_width(priv->fbScaled);
+    int wh = cairo_image_surface_get_height(priv->fbScaled);
+    int fbw = vnc_framebuffer_get_width(VNC_FRAMEBUFFER(priv->fb));
+    int fbh = vnc_framebuffer_get_height(VNC_FRAMEBUFFER(priv->fb));
+    cairo_t *cr;
+
+    if (w <= 0 || h <= 0)
+        return;
+
+    cr = cairo_create(priv->fbScaled);
+    cairo_rectangle(cr, x, y, w, h);
+    cairo_clip(cr);
+    cairo_scale(cr, (double)ww / (double)fbw, (double)wh / (double)fbh);
+    cairo_set_source_surface(cr, surface, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    /* Sample beyond the edges as the edge pixels, not black */
+    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+}
+
+/*
+ * Make sure the pre-scaled copy of the desktop matches the
+ * widget size, rebuilding it completely if the size changed.
+ * Subsequent updates only resample the damaged areas, so
+ * drawing is a plain copy
+ */
+static void setup_scaled_surface(VncDisplay *dpy, int ww, int wh)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+
+    if (priv->fbScaled &&
+        cairo_image_surface_get_width(priv->fbScaled) == ww &&
+        cairo_image_surface_get_height(priv->fbScaled) == wh)
+        return;
+
+    if (priv->fbScaled)
+        cairo_surface_destroy(priv->fbScaled);
+    priv->fbScaled = cairo_image_surface_create(CAIRO_FORMAT_RGB24, ww, wh);
+
+    render_scaled_surface(dpy, 0, 0, ww, wh);
+}
+
+static void free_scaled_surface(VncDisplay *dpy)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+
+    if (priv->fbScaled) {
+        cairo_surface_destroy(priv->fbScaled);
+        priv->fbScaled = NULL;
+    }
+}
+
+#ifdef VNC_DISPLAY_GL
+static gboolean gl_setup(VncDisplay *dpy)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+    GdkWindow *window = gtk_widget_get_window(GTK_WIDGET(dpy));
+    GError *err = NULL;
+
+    if (priv->gl_context)
+        return TRUE;
+    if (priv->gl_failed)
+        return FALSE;
+
+    priv->gl_context = gdk_window_create_gl_context(window, &err);
+    if (priv->gl_context &&
+        !gdk_gl_context_realize(priv->gl_context, &err)) {
+        g_object_unref(priv->gl_context);
+        priv->gl_context = NULL;
+    }
+    if (!priv->gl_context) {
+        VNC_DEBUG("Cannot render with OpenGL: %s", err->message);
+        g_clear_error(&err);
+        priv->gl_failed = TRUE;
+        return FALSE;
+    }
+
+    gdk_gl_context_make_current(priv->gl_context);
+
+    /* Texture format and blit need desktop GL 3.0 */
+    if (!epoxy_is_desktop_gl() || epoxy_gl_version() < 30) {
+        VNC_DEBUG("Cannot render with OpenGL: version %d too old",
+                  epoxy_gl_version());
+        gdk_gl_context_clear_current();
+        g_object_unref(priv->gl_context);
+        priv->gl_context = NULL;
+        priv->gl_failed = TRUE;
+        return FALSE;
+    }
+
+    glGenFramebuffers(2, priv->gl_fbo);
+    glGenTextures(1, &priv->gl_texture);
+    glGenTextures(1, &priv->gl_target);
+    priv->gl_width = priv->gl_height = 0;
+    priv->gl_target_width = priv->gl_target_height = 0;
+
+    return TRUE;
+}
+
+static void gl_free(VncDisplay *dpy)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+
+    if (priv->gl_context) {
+        gdk_gl_context_make_current(priv->gl_context);
+        glDeleteFramebuffers(2, priv->gl_fbo);
+        glDeleteTextures(1, &priv->gl_texture);
+        glDeleteTextures(1, &priv->gl_target);
+        gdk_gl_context_clear_current();
+        g_object_unref(priv->gl_context);
+        priv->gl_context = NULL;
+    }
+    if (priv->gl_upload) {
+        cairo_region_destroy(priv->gl_upload);
+        priv->gl_upload = NULL;
+    }
+    priv->gl_width = priv->gl_height = 0;
+    priv->gl_target_width = priv->gl_target_height = 0;
+}
+
+static void gl_texture_alloc(GLuint texture, int w, int h)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0,
+                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+}
+
+/*
+ * Bring the textures up to date for drawing a widget
+ * of 'ww' x 'wh'. Only the areas of the desktop which
+ * changed are uploaded, straight from the image surface
+ * since a native endian xRGB word is what the texture
+ * wants. Scaling, and flipping into the row order GDK
+ * expects, is then done by the GPU in a single blit
+ */
+static gboolean gl_prepare(VncDisplay *dpy, int ww, int wh)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+    int fbw = vnc_framebuffer_get_width(VNC_FRAMEBUFFER(priv->fb));
+    int fbh = vnc_framebuffer_get_height(VNC_FRAMEBUFFER(priv->fb));
+    int tw = priv->allow_scaling ? ww : fbw;
+    int th = priv->allow_scaling ? wh : fbh;
+
+    if (!gl_setup(dpy))
+        return FALSE;
+
+    gdk_gl_context_make_current(priv->gl_context);
+
+    if (priv->gl_width != fbw || priv->gl_height != fbh) {
+        cairo_rectangle_int_t all = { 0, 0, fbw, fbh };
+
+        gl_texture_alloc(priv->gl_texture, fbw, fbh);
+        priv->gl_width = fbw;
+        priv->gl_height = fbh;
+
+        if (priv->gl_upload)
+            cairo_region_destroy(priv->gl_upload);
+        priv->gl_upload = cairo_region_create_rectangle(&all);
+    }
+
+    if (priv->gl_upload) {
+        cairo_surface_t *surface = vnc_cairo_framebuffer_get_surface(priv->fb);
+        const guint8 *data;
+        int stride;
+        int i, n;
+
+        cairo_surface_flush(surface);
+        data = cairo_image_surface_get_data(surface);
+        stride = cairo_image_surface_get_stride(surface);
+
+        glBindTexture(GL_TEXTURE_2D, priv->gl_texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / 4);
+
+        n = cairo_region_num_rectangles(priv->gl_upload);
+        for (i = 0; i < n; i++) {
+            cairo_rectangle_int_t rect;
+
+            cairo_region_get_rectangle(priv->gl_upload, i, &rect);
+            glTexSubImage2D(GL_TEXTURE_2D, 0,
+                            rect.x, rect.y, rect.width, rect.height,
+                            GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                            data + (rect.y * stride) + (rect.x * 4));
+        }
+
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        cairo_region_destroy(priv->gl_upload);
+        priv->gl_upload = NULL;
+        priv->gl_redraw = TRUE;
+    }
+
+    if (priv->gl_target_width != tw || priv->gl_target_height != th) {
+        gl_texture_alloc(priv->gl_target, tw, th);
+        priv->gl_target_width = tw;
+        priv->gl_target_height = th;
+        priv->gl_redraw = TRUE;
+    }
+
+    if (priv->gl_redraw) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, priv->gl_fbo[0]);
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, priv->gl_texture, 0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, priv->gl_fbo[1]);
+        glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, priv->gl_target, 0);
+        glBlitFramebuffer(0, 0, fbw, fbh,
+                          0, th, tw, 0,
+                          GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        priv->gl_redraw = FALSE;
+    }
+
+    return TRUE;
+}
+
+static void gl_paint(VncDisplay *dpy, cairo_t *cr, int x, int y)
+{
+    VncDisplayPrivate *priv = dpy->priv;
+
+    cairo_save(cr);
+    cairo_translate(cr, x, y);
+    gdk_cairo_draw_from_gl(cr, gtk_widget_get_window(GTK_WIDGET(dpy)),
+                           priv->gl_target, GL_TEXTURE, 1,
+                           0, 0,
+                           priv->gl_target_width, priv->gl_target_height);
+    cairo_restore(cr);
+}
+
+static gboolean gl_in_use(VncDisplay *dpy)
+{
+    return dpy->priv->gl_render && !dpy->priv->gl_failed;
+}
+#endif
+
+/*
+ * Paint the thumbnail, stretched to fill the widget when
+ * scaling, otherwise centred at its own size
+ */
+static void draw_thumbnail(VncDisplay *obj, cairo_t *cr, int ww, int wh)
+{
+    VncDisplayPrivate *priv = obj->priv;
+    cairo_surface_t *surface = vnc_thumbnail_framebuffer_get_surface(priv->thumb);
+    int tw = cairo_image_surface_get_width(surface);
+    int th = cairo_image_surface_get_height(surface);
+    int mx = 0, my = 0;
+
+    if (!priv->allow_scaling) {
+        if (ww > tw)
+            mx = (ww - tw) / 2;
+        if (wh > th)
+            my = (wh - th) / 2;
+
+        cairo_rectangle(cr, 0, 0, ww, wh);
+        cairo_rectangle(cr, mx + tw, my,
+                        -1 * tw, th);
+        cairo_fill(cr);
+    }
+
+    vnc_thumbnail_framebuffer_lock(priv->thumb);
+    cairo_save(cr);
+    if (priv->allow_scaling) {
+        cairo_scale(cr, (double)ww / (double)tw, (double)wh / (double)th);
+        cairo_set_source_surface(cr, surface, 0, 0);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+        cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+    } else {
+        cairo_set_source_surface(cr, surface, mx, my);
+    }
+    cairo_paint(cr);
+    cairo_restore(cr);
+    vnc_thumbnail_framebuffer_unlock(priv->thumb);
+}
+
 static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
 {
     VncDisplay *obj = VNC_DISPLAY(widget);
@@ -380,16 +886,45 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
     int ww, wh;
     int mx = 0, my = 0;
     int fbw = 0, fbh = 0;
+    gboolean gl = FALSE;
+
+    if (priv->thumb) {
+        gdk_drawable_get_size(gtk_widget_get_window(widget), &ww, &wh);
+        draw_thumbnail(obj, cr, ww, wh);
+        return TRUE;
+    }
 
     if (priv->fb) {
         fbw = vnc_framebuffer_get_width(VNC_FRAMEBUFFER(priv->fb));
         fbh = vnc_framebuffer_get_height(VNC_FRAMEBUFFER(priv->fb));
-
-        setup_surface_cache(obj, cr, fbw, fbh);
     }
 
     gdk_drawable_get_size(gtk_widget_get_window(widget), &ww, &wh);
 
+#if GTK_CHECK_VERSION(3, 0, 0)
+    /* Scrolling the widget into view exposes it, so pick
+     * up newly visible areas of the desktop here */
+    if (priv->fb && priv->visible &&
+        vnc_connection_is_initialized(priv->conn)) {
+        cairo_rectangle_int_t roi;
+
+        visible_desktop_rect(obj, &roi);
+        update_region_of_interest(obj, &roi);
+    }
+#endif
+
+#ifdef VNC_DISPLAY_GL
+    if (priv->fb && priv->gl_render)
+        gl = gl_prepare(obj, ww, wh);
+#endif
+
+    if (priv->fb && !gl) {
+        if (priv->allow_scaling)
+            setup_scaled_surface(obj, ww, wh);
+        else if (!priv->direct_render)
+            setup_surface_cache(obj, cr, fbw, fbh);
+    }
+
     if (ww > fbw)
         mx = (ww - fbw) / 2;
     if (wh > fbh)
@@ -412,20 +947,32 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
     }
 
     /* Draw the VNC display */
+#ifdef VNC_DISPLAY_GL
+    if (gl) {
+        if (priv->allow_scaling)
+            gl_paint(obj, cr, 0, 0);
+        else
+            gl_paint(obj, cr, mx, my);
+        return TRUE;
+    }
+#endif
     if (priv->fb) {
+        /* In direct mode the image surface is uploaded to the
+         * window as-is, limited to the clip region covering the
+         * damage, instead of going via the server side pixmap */
+        cairo_surface_t *source = priv->direct_render ?
+            vnc_cairo_framebuffer_get_surface(priv->fb) :
+            priv->fbCache;
+
         if (priv->allow_scaling) {
-            double sx, sy;
-            /* Scale to fill window */
-            sx = (double)ww / (double)fbw;
-            sy = (double)wh / (double)fbh;
-            cairo_scale(cr, sx, sy);
+            /* Already scaled to fill window */
             cairo_set_source_surface(cr,
-                                     priv->fbCache,
+                                     priv->fbScaled,
                                      0,
                                      0);
         } else {
             cairo_set_source_surface(cr,
-                                     priv->fbCache,
+                                     source,
                                      mx,
                                      my);
         }
@@ -698,7 +1245,8 @@ static gboolean button_event(GtkWidget *widget, GdkEventButton *button)
     if (priv->conn == NULL || !vnc_connection_is_initialized(priv->conn))
         return FALSE;
 
-    if (priv->read_only)
+    /* Thumbnails are view only */
+    if (priv->read_only || priv->thumb)
         return FALSE;
 
     gtk_widget_grab_focus (widget);
@@ -732,7 +1280,8 @@ static gboolean scroll_event(GtkWidget *widget, GdkEventScroll *scroll)
     if (priv->conn == NULL || !vnc_connection_is_initialized(priv->conn))
         return FALSE;
 
-    if (priv->read_only)
+    /* Thumbnails are view only */
+    if (priv->read_only || priv->thumb)
         return FALSE;
 
     if (scroll->direction == GDK_SCROLL_UP)
@@ -965,7 +1514,8 @@ static gboolean key_event(GtkWidget *widget, GdkEventKey *key)
     if (priv->conn == NULL || !vnc_connection_is_initialized(priv->conn))
         return FALSE;
 
-    if (priv->read_only)
+    /* Thumbnails are view only */
+    if (priv->read_only || priv->thumb)
         return FALSE;
 
     VNC_DEBUG("%s keycode: %d  state: %u  group %d, keyval: %d",
@@ -1077,6 +1627,9 @@ static gboolean enter_event(GtkWidget *widget, GdkEventCrossing *crossing G_GNUC
     if (priv->conn == NULL || !vnc_connection_is_initialized(priv->conn))
         return FALSE;
 
+    if (priv->thumb)
+        return FALSE;
+
     if (priv->grab_keyboard)
         do_keyboard_grab(VNC_DISPLAY(widget), FALSE);
 
@@ -1139,49 +1692,374 @@ static gboolean focus_in_event(GtkWidget *widget, GdkEventFocus *focus G_GNUC_UN
     if (!gtk_widget_get_realized(widget))
         return TRUE;
 
-#ifdef G_OS_WIN32
-    win32_window = gdk_win32_window_get_impl_hwnd(gtk_widget_get_window(widget));
-#endif
+#ifdef G_OS_WIN32
+    win32_window = gdk_win32_window_get_impl_hwnd(gtk_widget_get_window(widget));
+#endif
+
+    return TRUE;
+}
+
+
+static gboolean focus_out_event(GtkWidget *widget, GdkEventFocus *focus G_GNUC_UNUSED)
+{
+    VncDisplayPrivate *priv = VNC_DISPLAY(widget)->priv;
+
+    if (priv->conn == NULL || !vnc_connection_is_initialized(priv->conn))
+        return FALSE;
+
+    release_keys(VNC_DISPLAY(widget));
+#ifdef G_OS_WIN32
+    win32_window = NULL;
+#endif
+
+    return TRUE;
+}
+
+
+static void grab_notify(GtkWidget *widget, gboolean was_grabbed)
+{
+    if (was_grabbed == FALSE)
+        release_keys(VNC_DISPLAY(widget));
+}
+
+
+static void realize_event(GtkWidget *widget)
+{
+    VncDisplay *obj = VNC_DISPLAY(widget);
+    VncDisplayPrivate *priv = obj->priv;
+
+    GTK_WIDGET_CLASS (vnc_display_parent_class)->realize (widget);
+
+    gdk_window_set_cursor(gtk_widget_get_window(GTK_WIDGET(obj)),
+                          priv->remote_cursor ? priv->remote_cursor : priv->null_cursor);
+}
+
+
+#ifdef VNC_DISPLAY_GL
+static void unrealize_event(GtkWidget *widget)
+{
+    VncDisplay *obj = VNC_DISPLAY(widget);
+
+    /* The GL context belongs to the window going away */
+    gl_free(obj);
+    obj->priv->gl_failed = FALSE;
+
+    GTK_WIDGET_CLASS (vnc_display_parent_class)->unrealize (widget);
+}
+#endif
+
+
+static void send_update_request(VncDisplay *obj)
+{
+    VncDisplayPrivate *priv = obj->priv;
+#if GTK_CHECK_VERSION(3, 0, 0)
+    cairo_rectangle_int_t roi;
+#endif
+
+    if (priv->update_clock)
+        g_timer_start(priv->update_clock);
+    else
+        priv->update_clock = g_timer_new();
+
+#if GTK_CHECK_VERSION(3, 0, 0)
+    /* Only ask for changes in the part which can be seen */
+    visible_desktop_rect(obj, &roi);
+    update_region_of_interest(obj, &roi);
+
+    vnc_connection_framebuffer_update_request(priv->conn, 1,
+                                              roi.x, roi.y,
+                                              roi.width, roi.height);
+#else
+    vnc_connection_framebuffer_update_request(priv->conn, 1,
+                                              0, 0,
+                                              vnc_connection_get_width(priv->conn),
+                                              vnc_connection_get_height(priv->conn));
+#endif
+}
+
+static guint current_fps_limit(VncDisplay *obj)
+{
+    VncDisplayPrivate *priv = obj->priv;
+    GtkWidget *toplevel = gtk_widget_get_toplevel(GTK_WIDGET(obj));
+
+    if (priv->background_fps &&
+        GTK_IS_WINDOW(toplevel) &&
+        !gtk_window_is_active(GTK_WINDOW(toplevel))) {
+        /* Never faster than the cap which applies when focused */
+        if (priv->max_fps)
+            return MIN(priv->max_fps, priv->background_fps);
+        return priv->background_fps;
+    }
+
+    return priv->max_fps;
+}
+
+static void request_next_update(VncDisplay *obj);
+
+static gboolean update_timer_expired(gpointer opaque)
+{
+    VncDisplay *obj = VNC_DISPLAY(opaque);
+    VncDisplayPrivate *priv = obj->priv;
+
+    priv->update_timer = 0;
+    if ((priv->fb || priv->thumb) && vnc_connection_is_initialized(priv->conn))
+        request_next_update(obj);
+
+    return FALSE;
+}
+
+/*
+ * Ask for the next incremental update, unless nobody can
+ * see the desktop. In that case the request is held back
+ * until the widget is visible again, and the server keeps
+ * accumulating the changes meanwhile. With a frame rate
+ * cap, the request is delayed until a frame interval has
+ * passed since the previous one
+ */
+static void request_next_update(VncDisplay *obj)
+{
+    VncDisplayPrivate *priv = obj->priv;
+    guint fps;
+
+    if (!priv->visible) {
+        priv->update_deferred = TRUE;
+        return;
+    }
+
+    /* Already scheduled */
+    if (priv->update_timer)
+        return;
+
+    fps = current_fps_limit(obj);
+    if (fps && priv->update_clock) {
+        gulong elapsed = (gulong)(g_timer_elapsed(priv->update_clock, NULL) * 1000);
+        gulong interval = 1000 / fps;
+
+        if (elapsed < interval) {
+            priv->update_timer = g_timeout_add(interval - elapsed,
+                                               update_timer_expired,
+                                               obj);
+            return;
+        }
+    }
+
+    send_update_request(obj);
+}
+
+static void cancel_update_timer(VncDisplay *obj)
+{
+    VncDisplayPrivate *priv = obj->priv;
+
+    if (priv->update_timer) {
+        g_source_remove(priv->update_timer);
+        priv->update_timer = 0;
+    }
+}
+
+static void update_visibility(VncDisplay *obj)
+{
+    VncDisplayPrivate *priv = obj->priv;
+    gboolean visible = priv->mapped && !priv->obscured && !priv->iconified;
+
+    if (priv->visible == visible)
+        return;
+
+    VNC_DEBUG("Display is now %s", visible ? "visible" : "hidden");
+    priv->visible = visible;
+
+    /* One incremental request catches up with everything
+     * which changed while hidden */
+    if (visible && priv->update_deferred) {
+        priv->update_deferred = FALSE;
+        if ((priv->fb || priv->thumb) && vnc_connection_is_initialized(priv->conn))
+            request_next_update(obj);
+    }
+}
+
+static void map_event(GtkWidget *widget)
+{
+    VncDisplay *obj = VNC_DISPLAY(widget);
+
+    GTK_WIDGET_CLASS (vnc_display_parent_class)->map (widget);
+
+    obj->priv->mapped = TRUE;
+    update_visibility(obj);
+}
+
+static void unmap_event(GtkWidget *widget)
+{
+    VncDisplay *obj = VNC_DISPLAY(widget);
+
+    /* A fresh visibility notify arrives with the next map */
+    obj->priv->mapped = FALSE;
+    obj->priv->obscured = FALSE;
+    update_visibility(obj);
+
+    GTK_WIDGET_CLASS (vnc_display_parent_class)->unmap (widget);
+}
+
+static gboolean visibility_event(GtkWidget *widget,
+                                 GdkEventVisibility *visibility)
+{
+    VncDisplay *obj = VNC_DISPLAY(widget);
+
+    obj->priv->obscured =
+        visibility->state == GDK_VISIBILITY_FULLY_OBSCURED;
+    update_visibility(obj);
+
+    return FALSE;
+}
+
+static gboolean toplevel_state_event(GtkWidget *toplevel G_GNUC_UNUSED,
+                                     GdkEventWindowState *state,
+                                     gpointer opaque)
+{
+    VncDisplay *obj = VNC_DISPLAY(opaque);
+
+    obj->priv->iconified =
+        (state->new_window_state & GDK_WINDOW_STATE_ICONIFIED) ? TRUE : FALSE;
+    update_visibility(obj);
+
+    return FALSE;
+}
+
+static void hierarchy_changed_event(GtkWidget *widget,
+                                    GtkWidget *previous_toplevel)
+{
+    VncDisplay *obj = VNC_DISPLAY(widget);
+    GtkWidget *toplevel = gtk_widget_get_toplevel(widget);
+
+    /* Minimizing is only reported to the toplevel window */
+    if (previous_toplevel && GTK_IS_WINDOW(previous_toplevel))
+        g_signal_handlers_disconnect_by_func(previous_toplevel,
+                                             toplevel_state_event,
+                                             obj);
+    obj->priv->iconified = FALSE;
+
+    if (gtk_widget_is_toplevel(toplevel) && GTK_IS_WINDOW(toplevel))
+        g_signal_connect(toplevel, "window-state-event",
+                         G_CALLBACK(toplevel_state_event), obj);
+
+    update_visibility(obj);
+}
+
+
+#if GTK_CHECK_VERSION(3, 8, 0)
+/*
+ * Runs once per frame while there is damage, so that
+ * however many rects arrive between two frames the widget
+ * is redrawn just once, and the server is only asked for
+ * more once the previous update has actually been shown
+ */
+static gboolean vnc_display_tick(GtkWidget *widget,
+                                 GdkFrameClock *clock G_GNUC_UNUSED,
+                                 gpointer opaque G_GNUC_UNUSED)
+{
+    VncDisplay *obj = VNC_DISPLAY(widget);
+    VncDisplayPrivate *priv = obj->priv;
+
+    if (priv->damage && !cairo_region_is_empty(priv->damage)) {
+        gtk_widget_queue_draw_region(widget, priv->damage);
+        cairo_region_destroy(priv->damage);
+        priv->damage = NULL;
+    }
+
+    if (priv->update_pending && (priv->fb || priv->thumb)) {
+        priv->update_pending = FALSE;
+        request_next_update(obj);
+    }
+
+    priv->tick_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void vnc_display_stop_ticks(VncDisplay *obj)
+{
+    VncDisplayPrivate *priv = obj->priv;
 
-    return TRUE;
+    if (priv->tick_id) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(obj), priv->tick_id);
+        priv->tick_id = 0;
+    }
+    if (priv->damage) {
+        cairo_region_destroy(priv->damage);
+        priv->damage = NULL;
+    }
+    priv->update_pending = FALSE;
 }
+#endif
 
 
-static gboolean focus_out_event(GtkWidget *widget, GdkEventFocus *focus G_GNUC_UNUSED)
+/*
+ * Queue a redraw of the widget area x,y,w,h, and the next
+ * update request along with it
+ */
+static void queue_damage(VncDisplay *obj, int x, int y, int w, int h)
 {
-    VncDisplayPrivate *priv = VNC_DISPLAY(widget)->priv;
+    GtkWidget *widget = GTK_WIDGET(obj);
+#if GTK_CHECK_VERSION(3, 8, 0)
+    VncDisplayPrivate *priv = obj->priv;
+    cairo_rectangle_int_t rect = { x, y, w, h };
 
-    if (priv->conn == NULL || !vnc_connection_is_initialized(priv->conn))
-        return FALSE;
+    if (!priv->damage)
+        priv->damage = cairo_region_create();
+    cairo_region_union_rectangle(priv->damage, &rect);
+    priv->update_pending = TRUE;
 
-    release_keys(VNC_DISPLAY(widget));
-#ifdef G_OS_WIN32
-    win32_window = NULL;
-#endif
+    if (!priv->tick_id)
+        priv->tick_id = gtk_widget_add_tick_callback(widget,
+                                                     vnc_display_tick,
+                                                     NULL, NULL);
+#else
+    gtk_widget_queue_draw_area(widget, x, y, w, h);
 
-    return TRUE;
+    request_next_update(obj);
+#endif
 }
 
-
-static void grab_notify(GtkWidget *widget, gboolean was_grabbed)
+/*
+ * Map the desktop area x,y,w,h onto the area of the
+ * widget showing that part of the thumbnail
+ */
+static void thumbnail_widget_rect(VncDisplay *obj, int ww, int wh,
+                                  int *x, int *y, int *w, int *h)
 {
-    if (was_grabbed == FALSE)
-        release_keys(VNC_DISPLAY(widget));
-}
+    VncDisplayPrivate *priv = obj->priv;
+    cairo_surface_t *surface = vnc_thumbnail_framebuffer_get_surface(priv->thumb);
+    int scale = vnc_thumbnail_framebuffer_get_scale(priv->thumb);
+    int tw = cairo_image_surface_get_width(surface);
+    int th = cairo_image_surface_get_height(surface);
+    int x0 = *x / scale;
+    int y0 = *y / scale;
+    int x1 = (*x + *w + scale - 1) / scale;
+    int y1 = (*y + *h + scale - 1) / scale;
 
+    if (priv->allow_scaling) {
+        /* Widened by a pixel for the filter reaching neighbours */
+        x0 = MAX(0, (x0 * ww) / tw - 1);
+        y0 = MAX(0, (y0 * wh) / th - 1);
+        x1 = MIN(ww, (x1 * ww + tw - 1) / tw + 1);
+        y1 = MIN(wh, (y1 * wh + th - 1) / th + 1);
+    } else {
+        int mx = 0, my = 0;
 
-static void realize_event(GtkWidget *widget)
-{
-    VncDisplay *obj = VNC_DISPLAY(widget);
-    VncDisplayPrivate *priv = obj->priv;
+        if (ww > tw)
+            mx = (ww - tw) / 2;
+        if (wh > th)
+            my = (wh - th) / 2;
 
-    GTK_WIDGET_CLASS (vnc_display_parent_class)->realize (widget);
+        x0 += mx;
+        y0 += my;
+        x1 += mx;
+        y1 += my;
+    }
 
-    gdk_window_set_cursor(gtk_widget_get_window(GTK_WIDGET(obj)),
-                          priv->remote_cursor ? priv->remote_cursor : priv->null_cursor);
+    *x = x0;
+    *y = y0;
+    *w = x1 - x0;
+    *h = y1 - y0;
 }
 
-
 static void on_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
                                   int x, int y, int w, int h,
                                   gpointer opaque)
@@ -1192,16 +2070,36 @@ static void on_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
     int ww, wh;
     int fbw, fbh;
 
+    gdk_drawable_get_size(gtk_widget_get_window(widget), &ww, &wh);
+
+    if (priv->thumb) {
+        cairo_surface_mark_dirty(vnc_thumbnail_framebuffer_get_surface(priv->thumb));
+        thumbnail_widget_rect(obj, ww, wh, &x, &y, &w, &h);
+        queue_damage(obj, x, y, w, h);
+        return;
+    }
+
     fbw = vnc_framebuffer_get_width(VNC_FRAMEBUFFER(priv->fb));
     fbh = vnc_framebuffer_get_height(VNC_FRAMEBUFFER(priv->fb));
 
-    gdk_drawable_get_size(gtk_widget_get_window(widget), &ww, &wh);
-
     /* If we have a pixmap, update the region which changed.
      * If we don't have a pixmap, the entire thing will be
      * created & rendered during the drawing handler
      */
-    if (priv->fbCache) {
+#ifdef VNC_DISPLAY_GL
+    if (gl_in_use(obj)) {
+        cairo_rectangle_int_t rect = { x, y, w, h };
+
+        /* Uploaded to the texture during the drawing handler */
+        if (!priv->gl_upload)
+            priv->gl_upload = cairo_region_create();
+        cairo_region_union_rectangle(priv->gl_upload, &rect);
+    } else
+#endif
+    if (priv->direct_render || priv->allow_scaling) {
+        cairo_surface_mark_dirty_rectangle(vnc_cairo_framebuffer_get_surface(priv->fb),
+                                           x, y, w, h);
+    } else if (priv->fbCache) {
         cairo_t *cr = cairo_create(priv->fbCache);
         cairo_surface_t *surface = vnc_cairo_framebuffer_get_surface(priv->fb);
 
@@ -1214,26 +2112,16 @@ static void on_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
     }
 
     if (priv->allow_scaling) {
-        double sx, sy;
-
-        /* Scale the VNC region to produce expose region */
-
-        sx = (double)ww / (double)fbw;
-        sy = (double)wh / (double)fbh;
-
-        x *= sx;
-        y *= sy;
-        w *= sx;
-        h *= sy;
-
-        /* Without this, we get horizontal & vertical line artifacts
-         * when drawing. This "fix" is somewhat dubious though. The
-         * true mistake & fix almost certainly lies elsewhere.
-         */
-        x -= 2;
-        y -= 2;
-        w += 4;
-        h += 4;
+        /* Scale the VNC region to produce expose region, and
+         * bring that part of the scaled copy up to date. If
+         * there is no scaled copy yet, it is created in full
+         * during the drawing handler */
+        scaled_surface_rect(obj, ww, wh, &x, &y, &w, &h);
+
+        if (priv->fbScaled &&
+            cairo_image_surface_get_width(priv->fbScaled) == ww &&
+            cairo_image_surface_get_height(priv->fbScaled) == wh)
+            render_scaled_surface(obj, x, y, w, h);
     } else {
         int mw = 0, mh = 0;
 
@@ -1248,12 +2136,7 @@ static void on_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
         y += mh;
     }
 
-    gtk_widget_queue_draw_area(widget, x, y, w, h);
-
-    vnc_connection_framebuffer_update_request(priv->conn, 1,
-                                              0, 0,
-                                              vnc_connection_get_width(priv->conn),
-                                              vnc_connection_get_height(priv->conn));
+    queue_damage(obj, x, y, w, h);
 }
 
 
@@ -1270,10 +2153,25 @@ static void do_framebuffer_init(VncDisplay *obj,
         g_object_unref(priv->fb);
         priv->fb = NULL;
     }
+    if (priv->thumb) {
+        g_object_unref(priv->thumb);
+        priv->thumb = NULL;
+    }
     if (priv->fbCache) {
         cairo_surface_destroy(priv->fbCache);
         priv->fbCache = NULL;
     }
+    free_scaled_surface(obj);
+#ifdef VNC_DISPLAY_GL
+    /* Forces a full upload of the new framebuffer */
+    priv->gl_width = priv->gl_height = 0;
+#endif
+#if GTK_CHECK_VERSION(3, 0, 0)
+    /* All callers follow up with a full update request */
+    priv->roi.x = priv->roi.y = 0;
+    priv->roi.width = width;
+    priv->roi.height = height;
+#endif
 
     if (priv->null_cursor == NULL) {
         priv->null_cursor = create_null_cursor();
@@ -1283,11 +2181,25 @@ static void do_framebuffer_init(VncDisplay *obj,
             do_pointer_hide(obj);
     }
 
-    priv->fb = vnc_cairo_framebuffer_new(width, height, remoteFormat);
-    vnc_connection_set_framebuffer(priv->conn, VNC_FRAMEBUFFER(priv->fb));
+    if (priv->thumbnail_scale > 1) {
+        priv->thumb = vnc_thumbnail_framebuffer_new(width, height, remoteFormat,
+                                                    priv->thumbnail_scale);
+        vnc_connection_set_framebuffer(priv->conn, VNC_FRAMEBUFFER(priv->thumb));
+    } else {
+        priv->fb = vnc_cairo_framebuffer_new(width, height, remoteFormat);
+        vnc_connection_set_framebuffer(priv->conn, VNC_FRAMEBUFFER(priv->fb));
+    }
 
-    if (priv->force_size)
-        gtk_widget_set_size_request(GTK_WIDGET(obj), width, height);
+    if (priv->force_size) {
+        if (priv->thumb) {
+            cairo_surface_t *surface = vnc_thumbnail_framebuffer_get_surface(priv->thumb);
+            gtk_widget_set_size_request(GTK_WIDGET(obj),
+                                        cairo_image_surface_get_width(surface),
+                                        cairo_image_surface_get_height(surface));
+        } else {
+            gtk_widget_set_size_request(GTK_WIDGET(obj), width, height);
+        }
+    }
 
     if (!quiet) {
         g_signal_emit(G_OBJECT(obj),
@@ -1745,6 +2657,12 @@ static void on_disconnected(VncConnection *conn G_GNUC_UNUSED,
     VncDisplay *obj = VNC_DISPLAY(opaque);
     VNC_DEBUG("Disconnected from VNC server");
 
+#if GTK_CHECK_VERSION(3, 8, 0)
+    vnc_display_stop_ticks(obj);
+#endif
+    obj->priv->update_deferred = FALSE;
+    cancel_update_timer(obj);
+
     g_signal_emit(G_OBJECT(obj), signals[VNC_DISCONNECTED], 0);
     g_object_unref(G_OBJECT(obj));
 }
@@ -2070,10 +2988,34 @@ static void vnc_display_finalize (GObject *obj)
         g_object_unref(priv->fb);
         priv->fb = NULL;
     }
+    if (priv->thumb) {
+        g_object_unref(priv->thumb);
+        priv->thumb = NULL;
+    }
     if (priv->fbCache) {
         cairo_surface_destroy(priv->fbCache);
         priv->fbCache = NULL;
     }
+    free_scaled_surface(display);
+#ifdef VNC_DISPLAY_GL
+    gl_free(display);
+#endif
+
+    cancel_update_timer(display);
+    if (priv->update_clock) {
+        g_timer_destroy(priv->update_clock);
+        priv->update_clock = NULL;
+    }
+
+#if GTK_CHECK_VERSION(3, 8, 0)
+    /* GTK already dropped the tick callback when destroying
+     * the widget, but damage may be left over from it */
+    if (priv->damage) {
+        cairo_region_destroy(priv->damage);
+        priv->damage = NULL;
+    }
+    priv->tick_id = 0;
+#endif
 
     if (priv->null_cursor) {
         gdk_cursor_unref (priv->null_cursor);
@@ -2121,6 +3063,13 @@ static void vnc_display_class_init(VncDisplayClass *klass)
     gtkwidget_class->focus_out_event = focus_out_event;
     gtkwidget_class->grab_notify = grab_notify;
     gtkwidget_class->realize = realize_event;
+    gtkwidget_class->map = map_event;
+    gtkwidget_class->unmap = unmap_event;
+    gtkwidget_class->visibility_notify_event = visibility_event;
+    gtkwidget_class->hierarchy_changed = hierarchy_changed_event;
+#ifdef VNC_DISPLAY_GL
+    gtkwidget_class->unrealize = unrealize_event;
+#endif
 
     object_class->finalize = vnc_display_finalize;
     object_class->get_property = vnc_display_get_property;
@@ -2284,6 +3233,67 @@ static void vnc_display_class_init(VncDisplayClass *klass)
                                                          G_PARAM_STATIC_NAME |
                                                          G_PARAM_STATIC_NICK |
                                                          G_PARAM_STATIC_BLURB));
+    g_object_class_install_property (object_class,
+                                     PROP_DIRECT_RENDER,
+                                     g_param_spec_boolean ( "direct-render",
+                                                            "Direct render",
+                                                            "Whether to draw straight from the framebuffer surface",
+                                                            FALSE,
+                                                            G_PARAM_READWRITE |
+                                                            G_PARAM_CONSTRUCT |
+                                                            G_PARAM_STATIC_NAME |
+                                                            G_PARAM_STATIC_NICK |
+                                                            G_PARAM_STATIC_BLURB));
+    g_object_class_install_property (object_class,
+                                     PROP_GL_RENDER,
+                                     g_param_spec_boolean ( "gl-render",
+                                                            "GL render",
+                                                            "Whether to draw and scale the desktop with OpenGL",
+                                                            FALSE,
+                                                            G_PARAM_READWRITE |
+                                                            G_PARAM_CONSTRUCT |
+                                                            G_PARAM_STATIC_NAME |
+                                                            G_PARAM_STATIC_NICK |
+                                                            G_PARAM_STATIC_BLURB));
+    g_object_class_install_property (object_class,
+                                     PROP_MAX_FPS,
+                                     g_param_spec_uint    ( "max-fps",
+                                                            "Max FPS",
+                                                            "Most updates per second to request, 0 for no limit",
+                                                            0,
+                                                            1000,
+                                                            0,
+                                                            G_PARAM_READWRITE |
+                                                            G_PARAM_CONSTRUCT |
+                                                            G_PARAM_STATIC_NAME |
+                                                            G_PARAM_STATIC_NICK |
+                                                            G_PARAM_STATIC_BLURB));
+    g_object_class_install_property (object_class,
+                                     PROP_BACKGROUND_FPS,
+                                     g_param_spec_uint    ( "background-fps",
+                                                            "Background FPS",
+                                                            "Most updates per second to request while the window is not focused, never above max-fps, 0 to use max-fps",
+                                                            0,
+                                                            1000,
+                                                            0,
+                                                            G_PARAM_READWRITE |
+                                                            G_PARAM_CONSTRUCT |
+                                                            G_PARAM_STATIC_NAME |
+                                                            G_PARAM_STATIC_NICK |
+                                                            G_PARAM_STATIC_BLURB));
+    g_object_class_install_property (object_class,
+                                     PROP_THUMBNAIL_SCALE,
+                                     g_param_spec_uint    ( "thumbnail-scale",
+                                                            "Thumbnail scale",
+                                                            "Factor to shrink the desktop by in thumbnail mode, 1 or less for a full size desktop",
+                                                            0,
+                                                            64,
+                                                            0,
+                                                            G_PARAM_READWRITE |
+                                                            G_PARAM_CONSTRUCT |
+                                                            G_PARAM_STATIC_NAME |
+                                                            G_PARAM_STATIC_NICK |
+                                                            G_PARAM_STATIC_BLURB));
 
     signals[VNC_CONNECTED] =
         g_signal_new ("vnc-connected",
@@ -2462,6 +3472,7 @@ static void vnc_display_init(VncDisplay *display)
                           GDK_ENTER_NOTIFY_MASK |
                           GDK_LEAVE_NOTIFY_MASK |
                           GDK_SCROLL_MASK |
+                          GDK_VISIBILITY_NOTIFY_MASK |
                           GDK_KEY_PRESS_MASK);
     /* We already have off-screen buffers we render to
      * but with GTK-3 there are problems with overlaid
@@ -2899,9 +3910,23 @@ gboolean vnc_display_set_scaling(VncDisplay *obj,
 {
     int ww, wh;
 
+    if (obj->priv->allow_scaling == enable)
+        return TRUE;
+
     obj->priv->allow_scaling = enable;
 
-    if (obj->priv->fb != NULL) {
+    /* Neither copy of the desktop is kept up to date
+     * while the other one is in use */
+    if (enable) {
+        if (obj->priv->fbCache) {
+            cairo_surface_destroy(obj->priv->fbCache);
+            obj->priv->fbCache = NULL;
+        }
+    } else {
+        free_scaled_surface(obj);
+    }
+
+    if (obj->priv->fb != NULL || obj->priv->thumb != NULL) {
         GdkWindow *window = gtk_widget_get_window(GTK_WIDGET(obj));
 
         if (window != NULL) {
@@ -2915,6 +3940,231 @@ gboolean vnc_display_set_scaling(VncDisplay *obj,
 }
 
 
+/**
+ * vnc_display_set_direct_render:
+ * @obj: (transfer none): the VNC display widget
+ * @enable: TRUE to draw straight from the framebuffer
+ *
+ * Set whether the widget draws directly from the client
+ * side image surface holding the remote desktop, or keeps
+ * a copy of it in a server side pixmap. Direct rendering
+ * avoids an extra copy of every update and the memory for
+ * the pixmap, which is preferable with a local display
+ * server or large desktops. The pixmap cache may still be
+ * faster when the display server is across a network.
+ */
+void vnc_display_set_direct_render(VncDisplay *obj, gboolean enable)
+{
+    VncDisplayPrivate *priv;
+
+    g_return_if_fail (VNC_IS_DISPLAY (obj));
+    priv = obj->priv;
+
+    if (priv->direct_render == enable)
+        return;
+
+    priv->direct_render = enable;
+
+    /* The cache is rebuilt on the next draw if needed */
+    if (priv->fbCache) {
+        cairo_surface_destroy(priv->fbCache);
+        priv->fbCache = NULL;
+    }
+
+    if (priv->fb != NULL && gtk_widget_get_window(GTK_WIDGET(obj)) != NULL)
+        gtk_widget_queue_draw(GTK_WIDGET(obj));
+}
+
+
+/**
+ * vnc_display_get_direct_render:
+ * @obj: (transfer none): the VNC display widget
+ *
+ * Determine whether the widget draws directly from
+ * the client side image surface
+ *
+ * Returns: TRUE if direct rendering is enabled, FALSE otherwise
+ */
+gboolean vnc_display_get_direct_render(VncDisplay *obj)
+{
+    g_return_val_if_fail (VNC_IS_DISPLAY (obj), FALSE);
+
+    return obj->priv->direct_render;
+}
+
+
+/**
+ * vnc_display_set_gl_render:
+ * @obj: (transfer none): the VNC display widget
+ * @enable: TRUE to draw the desktop using OpenGL
+ *
+ * Set whether the widget keeps the remote desktop in an
+ * OpenGL texture, uploading only the areas which change,
+ * and leaves scaling and drawing it to the GPU. This works
+ * with software renderers too, but pays off most with real
+ * hardware. If gtk-vnc was built without OpenGL support, or
+ * no OpenGL context can be created for the widget, it falls
+ * back to drawing with cairo.
+ */
+void vnc_display_set_gl_render(VncDisplay *obj, gboolean enable)
+{
+    VncDisplayPrivate *priv;
+
+    g_return_if_fail (VNC_IS_DISPLAY (obj));
+    priv = obj->priv;
+
+    if (priv->gl_render == enable)
+        return;
+
+    priv->gl_render = enable;
+
+    /* Whichever copy of the desktop is used next gets
+     * rebuilt in full on the next draw */
+    if (priv->fbCache) {
+        cairo_surface_destroy(priv->fbCache);
+        priv->fbCache = NULL;
+    }
+    free_scaled_surface(obj);
+#ifdef VNC_DISPLAY_GL
+    gl_free(obj);
+    priv->gl_failed = FALSE;
+#endif
+
+    if (priv->fb != NULL && gtk_widget_get_window(GTK_WIDGET(obj)) != NULL)
+        gtk_widget_queue_draw(GTK_WIDGET(obj));
+}
+
+
+/**
+ * vnc_display_get_gl_render:
+ * @obj: (transfer none): the VNC display widget
+ *
+ * Determine whether the widget has been asked to draw
+ * the desktop using OpenGL
+ *
+ * Returns: TRUE if OpenGL rendering is enabled, FALSE otherwise
+ */
+gboolean vnc_display_get_gl_render(VncDisplay *obj)
+{
+    g_return_val_if_fail (VNC_IS_DISPLAY (obj), FALSE);
+
+    return obj->priv->gl_render;
+}
+
+
+/**
+ * vnc_display_set_max_fps:
+ * @obj: (transfer none): the VNC display widget
+ * @fps: the most updates to request per second, or 0
+ *
+ * Limit how often the widget asks the server for a new
+ * frame. The next update is requested no sooner than
+ * 1/@fps seconds after the previous one, so the cost of
+ * decoding a busy desktop stays bounded. A value of 0
+ * requests updates as fast as the server provides them.
+ */
+void vnc_display_set_max_fps(VncDisplay *obj, guint fps)
+{
+    g_return_if_fail (VNC_IS_DISPLAY (obj));
+
+    obj->priv->max_fps = fps;
+}
+
+
+/**
+ * vnc_display_get_max_fps:
+ * @obj: (transfer none): the VNC display widget
+ *
+ * Determine the frame rate cap for update requests
+ *
+ * Returns: the most updates requested per second, or 0 for no limit
+ */
+guint vnc_display_get_max_fps(VncDisplay *obj)
+{
+    g_return_val_if_fail (VNC_IS_DISPLAY (obj), 0);
+
+    return obj->priv->max_fps;
+}
+
+
+/**
+ * vnc_display_set_background_fps:
+ * @obj: (transfer none): the VNC display widget
+ * @fps: the most updates to request per second, or 0
+ *
+ * Set a separate frame rate cap, used instead of the one
+ * from vnc_display_set_max_fps() while the window holding
+ * the widget is not focused. It never raises the rate
+ * above that cap, if one is set. A value of 0 applies
+ * the same cap whether focused or not.
+ */
+void vnc_display_set_background_fps(VncDisplay *obj, guint fps)
+{
+    g_return_if_fail (VNC_IS_DISPLAY (obj));
+
+    obj->priv->background_fps = fps;
+}
+
+
+/**
+ * vnc_display_get_background_fps:
+ * @obj: (transfer none): the VNC display widget
+ *
+ * Determine the frame rate cap for update requests
+ * while the window is not focused
+ *
+ * Returns: the most updates requested per second, or 0 to use max-fps
+ */
+guint vnc_display_get_background_fps(VncDisplay *obj)
+{
+    g_return_val_if_fail (VNC_IS_DISPLAY (obj), 0);
+
+    return obj->priv->background_fps;
+}
+
+
+/**
+ * vnc_display_set_thumbnail_scale:
+ * @obj: (transfer none): the VNC display widget
+ * @scale: the factor to shrink the desktop by
+ *
+ * Put the widget in thumbnail mode, for showing many
+ * desktops at once. With a @scale greater than 1 only a
+ * copy of the desktop shrunk by @scale in each direction
+ * is kept, built as updates are decoded, so memory and
+ * drawing costs fall by the square of @scale. The
+ * thumbnail is view only: pointer and key events are not
+ * sent, nothing is grabbed, and vnc_display_get_pixbuf()
+ * returns NULL. With force size on, the widget asks for
+ * the size of the thumbnail. A @scale of 0 or 1 shows the
+ * full size desktop. The change applies from the next
+ * connection or desktop resize.
+ */
+void vnc_display_set_thumbnail_scale(VncDisplay *obj, guint scale)
+{
+    g_return_if_fail (VNC_IS_DISPLAY (obj));
+
+    obj->priv->thumbnail_scale = scale;
+}
+
+
+/**
+ * vnc_display_get_thumbnail_scale:
+ * @obj: (transfer none): the VNC display widget
+ *
+ * Determine the factor the desktop is shrunk by in
+ * thumbnail mode
+ *
+ * Returns: the scale factor, or 1 or less if not in thumbnail mode
+ */
+guint vnc_display_get_thumbnail_scale(VncDisplay *obj)
+{
+    g_return_val_if_fail (VNC_IS_DISPLAY (obj), 0);
+
+    return obj->priv->thumbnail_scale;
+}
+
+
 /**
  * vnc_display_force_size:
  * @obj: (transfer none): the VNC display widget
@@ -134,6 +134,17 @@ gboolean vnc_display_get_scaling(VncDisplay *obj);
 void vnc_display_set_force_size(VncDisplay *obj, gboolean enable);
 gboolean vnc_display_get_force_size(VncDisplay *obj);
 
+void vnc_display_set_direct_render(VncDisplay *obj, gboolean enable);
+gboolean vnc_display_get_direct_render(VncDisplay *obj);
+void vnc_display_set_gl_render(VncDisplay *obj, gboolean enable);
+gboolean vnc_display_get_gl_render(VncDisplay *obj);
+void vnc_display_set_max_fps(VncDisplay *obj, guint fps);
+guint vnc_display_get_max_fps(VncDisplay *obj);
+void vnc_display_set_background_fps(VncDisplay *obj, guint fps);
+guint vnc_display_get_background_fps(VncDisplay *obj);
+void vnc_display_set_thumbnail_scale(VncDisplay *obj, guint scale);
+guint vnc_display_get_thumbnail_scale(VncDisplay *obj);
+
 void vnc_display_set_shared_flag(VncDisplay *obj, gboolean shared);
 gboolean vnc_display_get_shared_flag(VncDisplay *obj);
 
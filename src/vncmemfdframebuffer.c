@@ -0,0 +1,295 @@
+/*
+ * GTK VNC Widget
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2009-2010 Daniel P. Berrange <dan@berrange.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* For memfd_create and the file sealing constants */
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include "vncmemfdframebuffer.h"
+#include "vncutil.h"
+
+#define VNC_MEMFD_FRAMEBUFFER_GET_PRIVATE(obj)                          \
+    (G_TYPE_INSTANCE_GET_PRIVATE((obj), VNC_TYPE_MEMFD_FRAMEBUFFER, VncMemfdFramebufferPrivate))
+
+struct _VncMemfdFramebufferPrivate {
+    int fd;
+    guint8 *map;
+    gsize size;
+    VncMemfdFramebufferHeader *header;
+    guint32 *tiles; /* Damage sequence of each tile */
+};
+
+
+G_DEFINE_TYPE(VncMemfdFramebuffer, vnc_memfd_framebuffer, VNC_TYPE_BASE_FRAMEBUFFER);
+
+
+static void vnc_memfd_framebuffer_finalize (GObject *object)
+{
+    VncMemfdFramebuffer *fb = VNC_MEMFD_FRAMEBUFFER(object);
+    VncMemfdFramebufferPrivate *priv = fb->priv;
+
+#ifdef HAVE_MEMFD_CREATE
+    if (priv->map)
+        munmap(priv->map, priv->size);
+#endif
+    if (priv->fd != -1)
+        close(priv->fd);
+
+    G_OBJECT_CLASS(vnc_memfd_framebuffer_parent_class)->finalize (object);
+}
+
+
+/*
+ * Publish the tiles changed by the update which just
+ * completed. The tiles are stamped with the new sequence
+ * number before the header's counter moves on, so a reader
+ * seeing the new counter value also sees the tiles
+ */
+static void vnc_memfd_framebuffer_frame_complete(VncBaseFramebuffer *base)
+{
+    VncMemfdFramebuffer *fb = VNC_MEMFD_FRAMEBUFFER(base);
+    VncMemfdFramebufferPrivate *priv = fb->priv;
+    guint8 *tiles;
+    guint cols, rows, n, i;
+    guint32 seq;
+
+    if (!vnc_base_framebuffer_fetch_damage(base, &tiles, &cols, &rows))
+        return;
+
+    seq = priv->header->damage_seq + 1;
+    n = MIN(cols * rows,
+            (guint)priv->header->damage_cols * priv->header->damage_rows);
+    for (i = 0; i < n; i++) {
+        if (tiles[i])
+            priv->tiles[i] = seq;
+    }
+
+    g_atomic_int_set((gint *)&priv->header->damage_seq, (gint)seq);
+
+    g_free(tiles);
+}
+
+
+static void vnc_memfd_framebuffer_class_init(VncMemfdFramebufferClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    VncBaseFramebufferClass *base_class = VNC_BASE_FRAMEBUFFER_CLASS (klass);
+
+    base_class->frame_complete = vnc_memfd_framebuffer_frame_complete;
+    object_class->finalize = vnc_memfd_framebuffer_finalize;
+
+    g_type_class_add_private(klass, sizeof(VncMemfdFramebufferPrivate));
+}
+
+
+void vnc_memfd_framebuffer_init(VncMemfdFramebuffer *fb)
+{
+    VncMemfdFramebufferPrivate *priv;
+
+    priv = fb->priv = VNC_MEMFD_FRAMEBUFFER_GET_PRIVATE(fb);
+
+    memset(priv, 0, sizeof(*priv));
+    priv->fd = -1;
+}
+
+
+/**
+ * vnc_memfd_framebuffer_new:
+ * @width: the remote desktop width
+ * @height: the remote desktop height
+ * @localFormat: (transfer none): the pixel format to store
+ * @remoteFormat: (transfer none): the remote pixel format
+ *
+ * Allocate a new framebuffer object which stores the remote
+ * desktop in an anonymous shared memory file, so that other
+ * processes can map it and read the live desktop without
+ * any copying. The memory starts with a
+ * #VncMemfdFramebufferHeader describing the size and format
+ * of the pixels, and where in the memory they begin. Its
+ * damage sequence counter is increased after every complete
+ * framebuffer update, once the damage tiles which changed
+ * have been stamped with the new value, so readers can poll
+ * the counter and only look at tiles newer than the value
+ * they last saw.
+ *
+ * The file is sealed against resizing, so it can be
+ * safely mapped by processes which do not trust the one
+ * holding the connection.
+ *
+ * Returns: (transfer full): the new frame buffer object, or
+ * NULL if shared memory files are not supported or cannot
+ * be sealed
+ */
+VncMemfdFramebuffer *vnc_memfd_framebuffer_new(guint16 width, guint16 height,
+                                               const VncPixelFormat *localFormat,
+                                               const VncPixelFormat *remoteFormat)
+{
+#ifdef HAVE_MEMFD_CREATE
+    VncMemfdFramebuffer *fb;
+    VncMemfdFramebufferPrivate *priv;
+    VncMemfdFramebufferHeader *header;
+    int bpp = localFormat->bits_per_pixel / 8;
+    int rowstride = ((width * bpp) + 3) & ~3;
+    guint cols = (width + VNC_BASE_FRAMEBUFFER_DAMAGE_TILE - 1) /
+        VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+    guint rows = (height + VNC_BASE_FRAMEBUFFER_DAMAGE_TILE - 1) /
+        VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+    gsize headerSize;
+    gsize size;
+    guint8 *map;
+    int fd;
+
+    /* Keep the pixels cache line aligned */
+    headerSize = sizeof(VncMemfdFramebufferHeader) + (cols * rows * sizeof(guint32));
+    headerSize = (headerSize + 63) & ~((gsize)63);
+    size = headerSize + ((gsize)rowstride * height);
+
+    VNC_DEBUG("Memfd %dx%d size %" G_GSIZE_FORMAT, width, height, size);
+
+    fd = memfd_create("gtk-vnc-framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        VNC_DEBUG("Unable to create memfd: %s", g_strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        VNC_DEBUG("Unable to size memfd: %s", g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    /* Readers may rely on the size never changing */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        VNC_DEBUG("Unable to seal memfd: %s", g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        VNC_DEBUG("Unable to map memfd: %s", g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    /* A new file reads as zeros, so only the fixed fields
+     * need filling in */
+    header = (VncMemfdFramebufferHeader *)map;
+    header->magic = VNC_MEMFD_FRAMEBUFFER_MAGIC;
+    header->version = VNC_MEMFD_FRAMEBUFFER_VERSION;
+    header->header_size = headerSize;
+    header->rowstride = rowstride;
+    header->width = width;
+    header->height = height;
+    header->damage_tile = VNC_BASE_FRAMEBUFFER_DAMAGE_TILE;
+    header->damage_cols = cols;
+    header->damage_rows = rows;
+    header->bits_per_pixel = localFormat->bits_per_pixel;
+    header->depth = localFormat->depth;
+    header->big_endian = localFormat->byte_order == G_BIG_ENDIAN ? 1 : 0;
+    header->true_color = localFormat->true_color_flag;
+    header->red_max = localFormat->red_max;
+    header->green_max = localFormat->green_max;
+    header->blue_max = localFormat->blue_max;
+    header->red_shift = localFormat->red_shift;
+    header->green_shift = localFormat->green_shift;
+    header->blue_shift = localFormat->blue_shift;
+
+    fb = VNC_MEMFD_FRAMEBUFFER(g_object_new(VNC_TYPE_MEMFD_FRAMEBUFFER,
+                                            "buffer", map + headerSize,
+                                            "width", width,
+                                            "height", height,
+                                            "rowstride", rowstride,
+                                            "local-format", localFormat,
+                                            "remote-format", remoteFormat,
+                                            NULL));
+    priv = fb->priv;
+
+    priv->fd = fd;
+    priv->map = map;
+    priv->size = size;
+    priv->header = header;
+    priv->tiles = (guint32 *)(header + 1);
+
+    return fb;
+#else
+    (void)width;
+    (void)height;
+    (void)localFormat;
+    (void)remoteFormat;
+    VNC_DEBUG("%s", "Shared memory files are not supported");
+    return NULL;
+#endif
+}
+
+
+/**
+ * vnc_memfd_framebuffer_get_fd:
+ * @fb: (transfer none): the framebuffer object
+ *
+ * Get the file descriptor of the shared memory holding
+ * the framebuffer, to pass on to other processes. It
+ * remains owned by the framebuffer object, and is closed
+ * when the object is finalized, so callers wanting to keep
+ * it should duplicate it.
+ *
+ * Returns: the file descriptor
+ */
+int vnc_memfd_framebuffer_get_fd(VncMemfdFramebuffer *fb)
+{
+    g_return_val_if_fail(VNC_IS_MEMFD_FRAMEBUFFER(fb), -1);
+
+    return fb->priv->fd;
+}
+
+
+/**
+ * vnc_memfd_framebuffer_get_size:
+ * @fb: (transfer none): the framebuffer object
+ *
+ * Get the size of the shared memory, header included,
+ * which is how much readers need to map
+ *
+ * Returns: the size in bytes
+ */
+gsize vnc_memfd_framebuffer_get_size(VncMemfdFramebuffer *fb)
+{
+    g_return_val_if_fail(VNC_IS_MEMFD_FRAMEBUFFER(fb), 0);
+
+    return fb->priv->size;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,129 @@
+/*
+ * GTK VNC Widget
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2009-2010 Daniel P. Berrange <dan@berrange.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef VNC_MEMFD_FRAMEBUFFER_H
+#define VNC_MEMFD_FRAMEBUFFER_H
+
+#include <glib-object.h>
+
+#include <vncbaseframebuffer.h>
+#include <vncutil.h>
+
+G_BEGIN_DECLS
+
+#define VNC_TYPE_MEMFD_FRAMEBUFFER            (vnc_memfd_framebuffer_get_type ())
+#define VNC_MEMFD_FRAMEBUFFER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), VNC_TYPE_MEMFD_FRAMEBUFFER, VncMemfdFramebuffer))
+#define VNC_MEMFD_FRAMEBUFFER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), VNC_TYPE_MEMFD_FRAMEBUFFER, VncMemfdFramebufferClass))
+#define VNC_IS_MEMFD_FRAMEBUFFER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), VNC_TYPE_MEMFD_FRAMEBUFFER))
+#define VNC_IS_MEMFD_FRAMEBUFFER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), VNC_TYPE_MEMFD_FRAMEBUFFER))
+#define VNC_MEMFD_FRAMEBUFFER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), VNC_TYPE_MEMFD_FRAMEBUFFER, VncMemfdFramebufferClass))
+
+
+typedef struct _VncMemfdFramebuffer VncMemfdFramebuffer;
+typedef struct _VncMemfdFramebufferPrivate VncMemfdFramebufferPrivate;
+typedef struct _VncMemfdFramebufferClass VncMemfdFramebufferClass;
+typedef struct _VncMemfdFramebufferHeader VncMemfdFramebufferHeader;
+
+struct _VncMemfdFramebuffer
+{
+    VncBaseFramebuffer parent;
+
+    VncMemfdFramebufferPrivate *priv;
+
+    /* Do not add fields to this struct */
+};
+
+struct _VncMemfdFramebufferClass
+{
+    VncBaseFramebufferClass parent_class;
+
+    /*
+     * If adding fields to this struct, remove corresponding
+     * amount of padding to avoid changing overall struct size
+     */
+    gpointer _vnc_reserved[VNC_PADDING];
+};
+
+#define VNC_MEMFD_FRAMEBUFFER_MAGIC 0x464E5647 /* "GVNF" */
+#define VNC_MEMFD_FRAMEBUFFER_VERSION 1
+
+/*
+ * Found at the start of the shared memory, in native byte
+ * order. Everything but 'damage_seq' is fixed for the life
+ * of the memory. It is followed by a guint32 per damage
+ * tile, row by row, holding the value of 'damage_seq' when
+ * the tile last changed. The pixels start 'header_size'
+ * bytes into the memory
+ */
+struct _VncMemfdFramebufferHeader
+{
+    guint32 magic;
+    guint32 version;
+    guint32 header_size;
+    guint32 rowstride;
+
+    guint16 width;
+    guint16 height;
+    guint16 damage_tile;
+    guint16 damage_cols;
+    guint16 damage_rows;
+
+    /* Local pixel format */
+    guint8 bits_per_pixel;
+    guint8 depth;
+    guint8 big_endian;
+    guint8 true_color;
+    guint16 red_max;
+    guint16 green_max;
+    guint16 blue_max;
+    guint8 red_shift;
+    guint8 green_shift;
+    guint8 blue_shift;
+    guint8 padding;
+
+    /* Bumped once the tiles of an update are marked */
+    guint32 damage_seq;
+
+    guint32 reserved[5];
+};
+
+
+GType vnc_memfd_framebuffer_get_type(void) G_GNUC_CONST;
+
+VncMemfdFramebuffer *vnc_memfd_framebuffer_new(guint16 width, guint16 height,
+                                               const VncPixelFormat *localFormat,
+                                               const VncPixelFormat *remoteFormat);
+
+int vnc_memfd_framebuffer_get_fd(VncMemfdFramebuffer *fb);
+gsize vnc_memfd_framebuffer_get_size(VncMemfdFramebuffer *fb);
+
+
+G_END_DECLS
+
+#endif /* VNC_MEMFD_FRAMEBUFFER_H */
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,609 @@
+/*
+ * GTK VNC Widget
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2009-2010 Daniel P. Berrange <dan@berrange.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "vncthumbnailframebuffer.h"
+#include "vncbaseframebuffer.h"
+#include "vncutil.h"
+
+#if GLIB_CHECK_VERSION(2, 31, 0)
+#define g_mutex_new() g_new0(GMutex, 1)
+#define g_mutex_free(m) g_free(m)
+#endif
+
+#define VNC_THUMBNAIL_FRAMEBUFFER_GET_PRIVATE(obj)                      \
+    (G_TYPE_INSTANCE_GET_PRIVATE((obj), VNC_TYPE_THUMBNAIL_FRAMEBUFFER, VncThumbnailFramebufferPrivate))
+
+struct _VncThumbnailFramebufferPrivate {
+    guint16 width;
+    guint16 height;
+    guint scale;
+    VncPixelFormat localFormat;
+    VncPixelFormat remoteFormat;
+
+    cairo_surface_t *surface;
+
+    /* Converts remote pixels to local ones, 'scale' rows
+     * at a time, ahead of being folded into the thumbnail */
+    VncBaseFramebuffer *strip;
+    guint8 *stripData;
+    int stripStride;
+
+    /* The thumbnail row whose band of desktop rows is being
+     * written, or -1. Pixels written to it are marked in
+     * stripMask, over columns dirtyX0 .. dirtyX1, and the
+     * row's values from before the first write are kept in
+     * bandBase to stand in for the pixels not yet written */
+    int band;
+    guint8 *stripMask;
+    guint32 *bandBase;
+    guint16 dirtyX0;
+    guint16 dirtyX1;
+
+    GMutex *lock;
+};
+
+enum {
+    VNC_THUMBNAIL_FRAMEBUFFER_BLT,
+    VNC_THUMBNAIL_FRAMEBUFFER_RGB24_BLT,
+    VNC_THUMBNAIL_FRAMEBUFFER_FILL,
+};
+
+static void vnc_thumbnail_framebuffer_interface_init (gpointer g_iface,
+                                                      gpointer iface_data);
+
+G_DEFINE_TYPE_EXTENDED(VncThumbnailFramebuffer, vnc_thumbnail_framebuffer, G_TYPE_OBJECT, 0,
+                       G_IMPLEMENT_INTERFACE(VNC_TYPE_FRAMEBUFFER, vnc_thumbnail_framebuffer_interface_init));
+
+
+static void vnc_thumbnail_framebuffer_finalize (GObject *object)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(object);
+    VncThumbnailFramebufferPrivate *priv = fb->priv;
+
+    if (priv->surface)
+        cairo_surface_destroy(priv->surface);
+    if (priv->strip)
+        g_object_unref(priv->strip);
+    g_free(priv->stripData);
+    g_free(priv->stripMask);
+    g_free(priv->bandBase);
+    if (priv->lock)
+        g_mutex_free(priv->lock);
+
+    G_OBJECT_CLASS(vnc_thumbnail_framebuffer_parent_class)->finalize (object);
+}
+
+
+static void vnc_thumbnail_framebuffer_class_init(VncThumbnailFramebufferClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->finalize = vnc_thumbnail_framebuffer_finalize;
+
+    g_type_class_add_private(klass, sizeof(VncThumbnailFramebufferPrivate));
+}
+
+
+void vnc_thumbnail_framebuffer_init(VncThumbnailFramebuffer *fb)
+{
+    VncThumbnailFramebufferPrivate *priv;
+
+    priv = fb->priv = VNC_THUMBNAIL_FRAMEBUFFER_GET_PRIVATE(fb);
+
+    memset(priv, 0, sizeof(*priv));
+}
+
+
+/*
+ * Recompute the thumbnail pixels covering the dirty columns of
+ * the band being written. Each is the average of the block of
+ * desktop pixels it covers, taking the pixels written so far
+ * from the strip and the rest to be as they were before the
+ * band was started. This can be repeated as more of the band
+ * is written, so is exact however the writes are split up
+ */
+static void vnc_thumbnail_framebuffer_fold(VncThumbnailFramebufferPrivate *priv)
+{
+    guint scale = priv->scale;
+    guint ty, blockh, tx;
+    guint32 *dst;
+
+    if (priv->band < 0 || priv->dirtyX0 >= priv->dirtyX1)
+        return;
+
+    ty = priv->band;
+    blockh = MIN((guint)priv->height, (ty + 1) * scale) - (ty * scale);
+    dst = (guint32 *)(cairo_image_surface_get_data(priv->surface) +
+                      (ty * cairo_image_surface_get_stride(priv->surface)));
+
+    for (tx = priv->dirtyX0 / scale; tx * scale < priv->dirtyX1; tx++) {
+        guint x0 = tx * scale;
+        guint x1 = MIN((guint)priv->width, (tx + 1) * scale);
+        guint area = (x1 - x0) * blockh;
+        guint count = 0;
+        guint r = 0, g = 0, b = 0;
+        guint i, j;
+
+        for (j = 0; j < blockh; j++) {
+            const guint32 *src = (const guint32 *)(priv->stripData + (j * priv->stripStride));
+            const guint8 *mask = priv->stripMask + (j * priv->width);
+
+            for (i = x0; i < x1; i++) {
+                if (!mask[i])
+                    continue;
+                r += (src[i] >> 16) & 0xff;
+                g += (src[i] >> 8) & 0xff;
+                b += src[i] & 0xff;
+                count++;
+            }
+        }
+
+        r += (area - count) * ((priv->bandBase[tx] >> 16) & 0xff);
+        g += (area - count) * ((priv->bandBase[tx] >> 8) & 0xff);
+        b += (area - count) * (priv->bandBase[tx] & 0xff);
+
+        dst[tx] = (((r + area / 2) / area) << 16) |
+            (((g + area / 2) / area) << 8) |
+            ((b + area / 2) / area);
+    }
+
+    cairo_surface_mark_dirty(priv->surface);
+}
+
+
+/*
+ * Fold whatever is left of the band being written into the
+ * thumbnail and forget it
+ */
+static void vnc_thumbnail_framebuffer_flush(VncThumbnailFramebufferPrivate *priv)
+{
+    guint j;
+
+    if (priv->band < 0)
+        return;
+
+    vnc_thumbnail_framebuffer_fold(priv);
+
+    if (priv->dirtyX0 < priv->dirtyX1) {
+        for (j = 0; j < priv->scale; j++)
+            memset(priv->stripMask + (j * priv->width) + priv->dirtyX0, 0,
+                   priv->dirtyX1 - priv->dirtyX0);
+    }
+
+    priv->band = -1;
+    priv->dirtyX0 = priv->width;
+    priv->dirtyX1 = 0;
+}
+
+
+/*
+ * Make thumbnail row 'ty' the band being written, keeping
+ * its current values to stand in for unwritten pixels
+ */
+static void vnc_thumbnail_framebuffer_start_band(VncThumbnailFramebufferPrivate *priv,
+                                                 int ty)
+{
+    guint8 *thumb;
+
+    if (priv->band == ty)
+        return;
+
+    vnc_thumbnail_framebuffer_flush(priv);
+
+    thumb = cairo_image_surface_get_data(priv->surface);
+    memcpy(priv->bandBase,
+           thumb + (ty * cairo_image_surface_get_stride(priv->surface)),
+           cairo_image_surface_get_width(priv->surface) * 4);
+    priv->band = ty;
+}
+
+
+/*
+ * Run a write through the strip, one thumbnail row at a
+ * time. A band is only folded into the thumbnail once the
+ * writes move on to another band, or the thumbnail is read
+ */
+static void vnc_thumbnail_framebuffer_write(VncThumbnailFramebuffer *fb,
+                                            int op,
+                                            guint8 *src,
+                                            int rowstride,
+                                            guint16 x, guint16 y,
+                                            guint16 width, guint16 height)
+{
+    VncThumbnailFramebufferPrivate *priv = fb->priv;
+    VncFramebuffer *strip = VNC_FRAMEBUFFER(priv->strip);
+    guint row = y;
+
+    if (width == 0 || height == 0)
+        return;
+
+    g_mutex_lock(priv->lock);
+
+    while (row < (guint)(y + height)) {
+        guint sy = row % priv->scale;
+        guint rows = MIN(priv->scale - sy, (guint)(y + height) - row);
+        guint j;
+
+        vnc_thumbnail_framebuffer_start_band(priv, row / priv->scale);
+
+        switch (op) {
+        case VNC_THUMBNAIL_FRAMEBUFFER_BLT:
+            vnc_framebuffer_blt(strip, src + ((row - y) * rowstride), rowstride,
+                                x, sy, width, rows);
+            break;
+        case VNC_THUMBNAIL_FRAMEBUFFER_RGB24_BLT:
+            vnc_framebuffer_rgb24_blt(strip, src + ((row - y) * rowstride), rowstride,
+                                      x, sy, width, rows);
+            break;
+        case VNC_THUMBNAIL_FRAMEBUFFER_FILL:
+            vnc_framebuffer_fill(strip, src, x, sy, width, rows);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+
+        for (j = sy; j < sy + rows; j++)
+            memset(priv->stripMask + (j * priv->width) + x, 1, width);
+        priv->dirtyX0 = MIN(priv->dirtyX0, x);
+        priv->dirtyX1 = MAX(priv->dirtyX1, x + width);
+
+        row += rows;
+    }
+
+    g_mutex_unlock(priv->lock);
+}
+
+
+static guint16 vnc_thumbnail_framebuffer_get_width(VncFramebuffer *iface)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+
+    return fb->priv->width;
+}
+
+
+static guint16 vnc_thumbnail_framebuffer_get_height(VncFramebuffer *iface)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+
+    return fb->priv->height;
+}
+
+
+static int vnc_thumbnail_framebuffer_get_rowstride(VncFramebuffer *iface)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+
+    return cairo_image_surface_get_stride(fb->priv->surface);
+}
+
+
+static guint8 *vnc_thumbnail_framebuffer_get_buffer(VncFramebuffer *iface)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+
+    return cairo_image_surface_get_data(fb->priv->surface);
+}
+
+
+static const VncPixelFormat *vnc_thumbnail_framebuffer_get_local_format(VncFramebuffer *iface)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+
+    return &fb->priv->localFormat;
+}
+
+
+static const VncPixelFormat *vnc_thumbnail_framebuffer_get_remote_format(VncFramebuffer *iface)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+
+    return &fb->priv->remoteFormat;
+}
+
+
+/* Never, since the buffer is not at desktop size, so
+ * pixels must not be read straight into it */
+static gboolean vnc_thumbnail_framebuffer_perfect_format_match(VncFramebuffer *iface G_GNUC_UNUSED)
+{
+    return FALSE;
+}
+
+
+static void vnc_thumbnail_framebuffer_set_pixel_at(VncFramebuffer *iface,
+                                                   guint8 *src,
+                                                   guint16 x, guint16 y)
+{
+    vnc_thumbnail_framebuffer_write(VNC_THUMBNAIL_FRAMEBUFFER(iface),
+                                    VNC_THUMBNAIL_FRAMEBUFFER_FILL,
+                                    src, 0, x, y, 1, 1);
+}
+
+
+static void vnc_thumbnail_framebuffer_fill(VncFramebuffer *iface,
+                                           guint8 *src,
+                                           guint16 x, guint16 y,
+                                           guint16 width, guint16 height)
+{
+    vnc_thumbnail_framebuffer_write(VNC_THUMBNAIL_FRAMEBUFFER(iface),
+                                    VNC_THUMBNAIL_FRAMEBUFFER_FILL,
+                                    src, 0, x, y, width, height);
+}
+
+
+static void vnc_thumbnail_framebuffer_blt(VncFramebuffer *iface,
+                                          guint8 *src,
+                                          int rowstride,
+                                          guint16 x, guint16 y,
+                                          guint16 width, guint16 height)
+{
+    vnc_thumbnail_framebuffer_write(VNC_THUMBNAIL_FRAMEBUFFER(iface),
+                                    VNC_THUMBNAIL_FRAMEBUFFER_BLT,
+                                    src, rowstride, x, y, width, height);
+}
+
+
+static void vnc_thumbnail_framebuffer_rgb24_blt(VncFramebuffer *iface,
+                                                guint8 *src,
+                                                int rowstride,
+                                                guint16 x, guint16 y,
+                                                guint16 width, guint16 height)
+{
+    vnc_thumbnail_framebuffer_write(VNC_THUMBNAIL_FRAMEBUFFER(iface),
+                                    VNC_THUMBNAIL_FRAMEBUFFER_RGB24_BLT,
+                                    src, rowstride, x, y, width, height);
+}
+
+
+/*
+ * The desktop itself is not kept, so the copy is done on
+ * the thumbnail, rounded out to whole thumbnail pixels
+ */
+static void vnc_thumbnail_framebuffer_copyrect(VncFramebuffer *iface,
+                                               guint16 srcx, guint16 srcy,
+                                               guint16 dstx, guint16 dsty,
+                                               guint16 width, guint16 height)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+    VncThumbnailFramebufferPrivate *priv = fb->priv;
+    guint scale = priv->scale;
+    int tw = cairo_image_surface_get_width(priv->surface);
+    int th = cairo_image_surface_get_height(priv->surface);
+    int stride = cairo_image_surface_get_stride(priv->surface);
+    guint8 *data = cairo_image_surface_get_data(priv->surface);
+    int sx = srcx / scale, sy = srcy / scale;
+    int dx = dstx / scale, dy = dsty / scale;
+    int w = (width + scale - 1) / scale;
+    int h = (height + scale - 1) / scale;
+    int i;
+
+    w = MIN(w, MIN(tw - sx, tw - dx));
+    h = MIN(h, MIN(th - sy, th - dy));
+    if (w <= 0 || h <= 0)
+        return;
+
+    g_mutex_lock(priv->lock);
+
+    /* The copy must see, and must not be undone by, the
+     * band being written */
+    vnc_thumbnail_framebuffer_flush(priv);
+
+    /* Walk rows in the direction which never overwrites
+     * a source row before it has been copied */
+    if (dy <= sy) {
+        for (i = 0; i < h; i++)
+            memmove(data + ((dy + i) * stride) + (dx * 4),
+                    data + ((sy + i) * stride) + (sx * 4),
+                    w * 4);
+    } else {
+        for (i = h - 1; i >= 0; i--)
+            memmove(data + ((dy + i) * stride) + (dx * 4),
+                    data + ((sy + i) * stride) + (sx * 4),
+                    w * 4);
+    }
+
+    g_mutex_unlock(priv->lock);
+}
+
+
+static void vnc_thumbnail_framebuffer_set_color_map(VncFramebuffer *iface,
+                                                    VncColorMap *map)
+{
+    VncThumbnailFramebuffer *fb = VNC_THUMBNAIL_FRAMEBUFFER(iface);
+
+    vnc_framebuffer_set_color_map(VNC_FRAMEBUFFER(fb->priv->strip), map);
+}
+
+
+static void vnc_thumbnail_framebuffer_interface_init(gpointer g_iface,
+                                                     gpointer iface_data G_GNUC_UNUSED)
+{
+    VncFramebufferInterface *iface = g_iface;
+
+    iface->get_width = vnc_thumbnail_framebuffer_get_width;
+    iface->get_height = vnc_thumbnail_framebuffer_get_height;
+    iface->get_rowstride = vnc_thumbnail_framebuffer_get_rowstride;
+    iface->get_buffer = vnc_thumbnail_framebuffer_get_buffer;
+    iface->get_local_format = vnc_thumbnail_framebuffer_get_local_format;
+    iface->get_remote_format = vnc_thumbnail_framebuffer_get_remote_format;
+    iface->perfect_format_match = vnc_thumbnail_framebuffer_perfect_format_match;
+
+    iface->set_pixel_at = vnc_thumbnail_framebuffer_set_pixel_at;
+    iface->fill = vnc_thumbnail_framebuffer_fill;
+    iface->copyrect = vnc_thumbnail_framebuffer_copyrect;
+    iface->blt = vnc_thumbnail_framebuffer_blt;
+    iface->rgb24_blt = vnc_thumbnail_framebuffer_rgb24_blt;
+    iface->set_color_map = vnc_thumbnail_framebuffer_set_color_map;
+}
+
+
+/**
+ * vnc_thumbnail_framebuffer_new:
+ * @width: the remote desktop width
+ * @height: the remote desktop height
+ * @remoteFormat: (transfer none): the remote pixel format
+ * @scale: the factor to shrink the desktop by
+ *
+ * Allocate a new framebuffer object which only keeps a copy
+ * of the remote desktop shrunk by @scale in each direction,
+ * in a cairo image surface. Each thumbnail pixel is the
+ * average of the block of desktop pixels it covers, and is
+ * updated as the pixels are written, so there is never any
+ * need to keep or rescale a full size copy of the desktop.
+ * Copies of areas of the desktop are approximated on the
+ * thumbnail, so servers should be asked not to use the
+ * CopyRect encoding for exact results.
+ *
+ * Returns: (transfer full): the new frame buffer object
+ */
+VncThumbnailFramebuffer *vnc_thumbnail_framebuffer_new(guint16 width, guint16 height,
+                                                       const VncPixelFormat *remoteFormat,
+                                                       guint scale)
+{
+    VncThumbnailFramebuffer *fb;
+    VncThumbnailFramebufferPrivate *priv;
+    int tw, th;
+
+    g_return_val_if_fail(scale >= 1, NULL);
+
+    tw = (width + scale - 1) / scale;
+    th = (height + scale - 1) / scale;
+
+    VNC_DEBUG("Thumbnail %dx%d of %dx%d", tw, th, width, height);
+
+    fb = VNC_THUMBNAIL_FRAMEBUFFER(g_object_new(VNC_TYPE_THUMBNAIL_FRAMEBUFFER,
+                                                NULL));
+    priv = fb->priv;
+
+    priv->width = width;
+    priv->height = height;
+    priv->scale = scale;
+    priv->remoteFormat = *remoteFormat;
+
+    priv->localFormat.red_max = 255;
+    priv->localFormat.green_max = 255;
+    priv->localFormat.blue_max = 255;
+    priv->localFormat.red_shift = 16;
+    priv->localFormat.green_shift = 8;
+    priv->localFormat.blue_shift = 0;
+    priv->localFormat.depth = 32;
+    priv->localFormat.bits_per_pixel = 32;
+    priv->localFormat.byte_order = G_BYTE_ORDER;
+
+    priv->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+                                               MAX(tw, 1), MAX(th, 1));
+    memset(cairo_image_surface_get_data(priv->surface), 0,
+           cairo_image_surface_get_stride(priv->surface) * MAX(th, 1));
+    cairo_surface_mark_dirty(priv->surface);
+
+    priv->stripStride = width * 4;
+    priv->stripData = g_new0(guint8, priv->stripStride * scale);
+    priv->stripMask = g_new0(guint8, width * scale);
+    priv->bandBase = g_new0(guint32, MAX(tw, 1));
+    priv->band = -1;
+    priv->dirtyX0 = width;
+    priv->dirtyX1 = 0;
+    priv->strip = vnc_base_framebuffer_new(priv->stripData,
+                                           width, scale,
+                                           priv->stripStride,
+                                           &priv->localFormat,
+                                           remoteFormat);
+    priv->lock = g_mutex_new();
+
+    return fb;
+}
+
+
+/**
+ * vnc_thumbnail_framebuffer_get_surface:
+ * @fb: (transfer none): the framebuffer object
+ *
+ * Get the cairo image surface holding the thumbnail. It is
+ * written by whichever thread decodes updates, so readers
+ * should hold the lock from vnc_thumbnail_framebuffer_lock
+ *
+ * Returns: (transfer none): the cairo surface
+ */
+cairo_surface_t *vnc_thumbnail_framebuffer_get_surface(VncThumbnailFramebuffer *fb)
+{
+    g_return_val_if_fail(VNC_IS_THUMBNAIL_FRAMEBUFFER(fb), NULL);
+
+    return fb->priv->surface;
+}
+
+
+/**
+ * vnc_thumbnail_framebuffer_get_scale:
+ * @fb: (transfer none): the framebuffer object
+ *
+ * Get the factor the desktop is shrunk by
+ *
+ * Returns: the scale factor
+ */
+guint vnc_thumbnail_framebuffer_get_scale(VncThumbnailFramebuffer *fb)
+{
+    g_return_val_if_fail(VNC_IS_THUMBNAIL_FRAMEBUFFER(fb), 1);
+
+    return fb->priv->scale;
+}
+
+
+/**
+ * vnc_thumbnail_framebuffer_lock:
+ * @fb: (transfer none): the framebuffer object
+ *
+ * Stop the thumbnail being written, while reading it. Any
+ * writes not yet folded into the thumbnail are folded first
+ */
+void vnc_thumbnail_framebuffer_lock(VncThumbnailFramebuffer *fb)
+{
+    g_return_if_fail(VNC_IS_THUMBNAIL_FRAMEBUFFER(fb));
+
+    g_mutex_lock(fb->priv->lock);
+    vnc_thumbnail_framebuffer_fold(fb->priv);
+}
+
+
+/**
+ * vnc_thumbnail_framebuffer_unlock:
+ * @fb: (transfer none): the framebuffer object
+ *
+ * Allow the thumbnail to be written again
+ */
+void vnc_thumbnail_framebuffer_unlock(VncThumbnailFramebuffer *fb)
+{
+    g_return_if_fail(VNC_IS_THUMBNAIL_FRAMEBUFFER(fb));
+
+    g_mutex_unlock(fb->priv->lock);
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,393 @@
+/*
+ * Vnc protocol parsing benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Feeds a VncConnection a synthetic stream of hextile or RRE
+ * framebuffer updates made of many small rects, from a child
+ * process over a socketpair, and reports how long the client
+ * took to parse it. The stream is generated up front so that
+ * only the client side is being timed.
+ *
+ * Run it against builds of libgvnc from before and after a
+ * change to compare the cost of protocol parsing, eg
+ *
+ *   ./gvncreadbench --encoding hextile --updates 200
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <vncconnection.h>
+#include <vncbaseframebuffer.h>
+
+#define BENCH_WIDTH 1024
+#define BENCH_HEIGHT 768
+#define BENCH_RECT 64
+
+struct GVncReadBench {
+    VncConnection *conn;
+    GMainLoop *loop;
+    GTimer *timer;
+    guint8 *pixels;
+
+    gboolean initialized;
+    guint nupdates;
+};
+
+static void put_u8(GByteArray *buf, guint8 val)
+{
+    g_byte_array_append(buf, &val, 1);
+}
+
+static void put_u16(GByteArray *buf, guint16 val)
+{
+    guint8 data[2] = { val >> 8, val & 0xff };
+    g_byte_array_append(buf, data, sizeof(data));
+}
+
+static void put_u32(GByteArray *buf, guint32 val)
+{
+    guint8 data[4] = { val >> 24, (val >> 16) & 0xff,
+                       (val >> 8) & 0xff, val & 0xff };
+    g_byte_array_append(buf, data, sizeof(data));
+}
+
+/* Pixels are sent as 32bpp little endian, as set in the ServerInit */
+static void put_pixel(GByteArray *buf, guint32 val)
+{
+    guint8 data[4] = { val & 0xff, (val >> 8) & 0xff,
+                       (val >> 16) & 0xff, val >> 24 };
+    g_byte_array_append(buf, data, sizeof(data));
+}
+
+static void put_handshake(GByteArray *buf)
+{
+    static const char name[] = "gvncreadbench";
+
+    g_byte_array_append(buf, (const guint8 *)"RFB 003.008\n", 12);
+
+    /* A single security type of None, then SecurityResult OK */
+    put_u8(buf, 1);
+    put_u8(buf, VNC_CONNECTION_AUTH_NONE);
+    put_u32(buf, 0);
+
+    /* ServerInit */
+    put_u16(buf, BENCH_WIDTH);
+    put_u16(buf, BENCH_HEIGHT);
+    put_u8(buf, 32);  /* bits-per-pixel */
+    put_u8(buf, 24);  /* depth */
+    put_u8(buf, 0);   /* big-endian-flag */
+    put_u8(buf, 1);   /* true-colour-flag */
+    put_u16(buf, 255);
+    put_u16(buf, 255);
+    put_u16(buf, 255);
+    put_u8(buf, 16);  /* red-shift */
+    put_u8(buf, 8);   /* green-shift */
+    put_u8(buf, 0);   /* blue-shift */
+    put_u8(buf, 0);
+    put_u8(buf, 0);
+    put_u8(buf, 0);
+    put_u32(buf, strlen(name));
+    g_byte_array_append(buf, (const guint8 *)name, strlen(name));
+}
+
+/* Each 16x16 tile gets a background and 'nsub' coloured subrects */
+static void put_hextile_rect(GByteArray *buf, GRand *rand, guint nsub)
+{
+    int tx, ty;
+    guint i;
+
+    for (ty = 0 ; ty < BENCH_RECT ; ty += 16) {
+        for (tx = 0 ; tx < BENCH_RECT ; tx += 16) {
+            put_u8(buf, 0x02 | 0x08 | 0x10);
+            put_pixel(buf, g_rand_int(rand));
+            put_u8(buf, nsub);
+            for (i = 0 ; i < nsub ; i++) {
+                guint8 sx = g_rand_int_range(rand, 0, 16);
+                guint8 sy = g_rand_int_range(rand, 0, 16);
+                guint8 sw = g_rand_int_range(rand, 1, 17 - sx);
+                guint8 sh = g_rand_int_range(rand, 1, 17 - sy);
+
+                put_pixel(buf, g_rand_int(rand));
+                put_u8(buf, (sx << 4) | sy);
+                put_u8(buf, ((sw - 1) << 4) | (sh - 1));
+            }
+        }
+    }
+}
+
+static void put_rre_rect(GByteArray *buf, GRand *rand, guint nsub)
+{
+    guint i;
+
+    put_u32(buf, nsub);
+    put_pixel(buf, g_rand_int(rand));
+    for (i = 0 ; i < nsub ; i++) {
+        guint16 sx = g_rand_int_range(rand, 0, BENCH_RECT);
+        guint16 sy = g_rand_int_range(rand, 0, BENCH_RECT);
+
+        put_pixel(buf, g_rand_int(rand));
+        put_u16(buf, sx);
+        put_u16(buf, sy);
+        put_u16(buf, g_rand_int_range(rand, 1, BENCH_RECT + 1 - sx));
+        put_u16(buf, g_rand_int_range(rand, 1, BENCH_RECT + 1 - sy));
+    }
+}
+
+static GByteArray *make_stream(gint32 encoding, guint nupdates, guint nsub)
+{
+    GByteArray *buf = g_byte_array_new();
+    GRand *rand = g_rand_new_with_seed(0x6776);
+    guint n;
+    int x, y;
+
+    put_handshake(buf);
+
+    for (n = 0 ; n < nupdates ; n++) {
+        put_u8(buf, 0);
+        put_u8(buf, 0);
+        put_u16(buf, (BENCH_WIDTH / BENCH_RECT) * (BENCH_HEIGHT / BENCH_RECT));
+
+        for (y = 0 ; y < BENCH_HEIGHT ; y += BENCH_RECT) {
+            for (x = 0 ; x < BENCH_WIDTH ; x += BENCH_RECT) {
+                put_u16(buf, x);
+                put_u16(buf, y);
+                put_u16(buf, BENCH_RECT);
+                put_u16(buf, BENCH_RECT);
+                put_u32(buf, encoding);
+
+                if (encoding == VNC_CONNECTION_ENCODING_HEXTILE)
+                    put_hextile_rect(buf, rand, nsub);
+                else
+                    put_rre_rect(buf, rand, nsub);
+            }
+        }
+    }
+
+    g_rand_free(rand);
+    return buf;
+}
+
+/*
+ * Runs in the child: push the whole stream, ignoring anything
+ * the client sends, then close the socket so that the client
+ * sees end of stream
+ */
+static void send_stream(int fd, GByteArray *buf)
+{
+    gsize done = 0;
+
+    while (done < buf->len) {
+        ssize_t ret = write(fd, buf->data + done, buf->len - done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+        done += ret;
+    }
+
+    close(fd);
+    _exit(EXIT_SUCCESS);
+}
+
+static void do_vnc_auth_choose_type(VncConnection *conn,
+                                    GValueArray *types G_GNUC_UNUSED,
+                                    gpointer opaque G_GNUC_UNUSED)
+{
+    vnc_connection_set_auth_type(conn, VNC_CONNECTION_AUTH_NONE);
+}
+
+static void do_vnc_initialized(VncConnection *conn,
+                               gpointer opaque)
+{
+    struct GVncReadBench *bench = opaque;
+    const VncPixelFormat *fmt = vnc_connection_get_pixel_format(conn);
+    int width = vnc_connection_get_width(conn);
+    int height = vnc_connection_get_height(conn);
+    VncBaseFramebuffer *fb;
+
+    /* Matching formats, so the blits are as cheap as they get */
+    bench->pixels = g_new0(guint8, width * height * 4);
+    fb = vnc_base_framebuffer_new(bench->pixels, width, height, width * 4,
+                                  fmt, fmt);
+    vnc_connection_set_framebuffer(conn, VNC_FRAMEBUFFER(fb));
+    g_object_unref(fb);
+
+    bench->initialized = TRUE;
+    g_timer_start(bench->timer);
+}
+
+static void do_vnc_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
+                                      guint16 x, guint16 y,
+                                      guint16 width, guint16 height,
+                                      gpointer opaque)
+{
+    struct GVncReadBench *bench = opaque;
+
+    if ((x + width) == BENCH_WIDTH &&
+        (y + height) == BENCH_HEIGHT)
+        bench->nupdates++;
+}
+
+static void do_vnc_disconnected(VncConnection *conn G_GNUC_UNUSED,
+                                gpointer opaque)
+{
+    struct GVncReadBench *bench = opaque;
+
+    g_timer_stop(bench->timer);
+    g_main_loop_quit(bench->loop);
+}
+
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar *encoding = NULL;
+    gint nupdates = 100;
+    gint nsub = 8;
+    const GOptionEntry options [] = {
+        { "encoding", 'e', 0, G_OPTION_ARG_STRING,
+          &encoding, "Encoding to send, 'hextile' or 'rre'", "ENCODING" },
+        { "updates", 'u', 0, G_OPTION_ARG_INT,
+          &nupdates, "Number of full screen updates to send", "N" },
+        { "subrects", 's', 0, G_OPTION_ARG_INT,
+          &nsub, "Subrects per hextile tile or RRE rect", "N" },
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
+    };
+    struct GVncReadBench bench;
+    GByteArray *stream;
+    gint32 etype;
+    int fds[2];
+    pid_t pid;
+    double secs;
+    guint nrects;
+
+    g_type_init();
+
+    context = g_option_context_new("- Vnc protocol parsing benchmark");
+    g_option_context_add_main_entries(context, options, NULL);
+    g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (error) {
+        g_print("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+
+    if (!encoding || g_str_equal(encoding, "hextile")) {
+        etype = VNC_CONNECTION_ENCODING_HEXTILE;
+        if (nsub < 0 || nsub > 255) {
+            g_print("Hextile tiles take 0 to 255 subrects\n");
+            return EXIT_FAILURE;
+        }
+    } else if (g_str_equal(encoding, "rre")) {
+        etype = VNC_CONNECTION_ENCODING_RRE;
+        if (nsub < 0) {
+            g_print("Subrect count must not be negative\n");
+            return EXIT_FAILURE;
+        }
+    } else {
+        g_print("Unknown encoding '%s'\n", encoding);
+        return EXIT_FAILURE;
+    }
+    if (nupdates <= 0) {
+        g_print("Update count must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    stream = make_stream(etype, nupdates, nsub);
+
+    /* The child exits without reading what the client sends */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        send_stream(fds[1], stream);
+    }
+    close(fds[1]);
+
+    memset(&bench, 0, sizeof(bench));
+    bench.conn = vnc_connection_new();
+    bench.loop = g_main_loop_new(g_main_context_default(), FALSE);
+    bench.timer = g_timer_new();
+
+    g_signal_connect(bench.conn, "vnc-auth-choose-type",
+                     G_CALLBACK(do_vnc_auth_choose_type), &bench);
+    g_signal_connect(bench.conn, "vnc-initialized",
+                     G_CALLBACK(do_vnc_initialized), &bench);
+    g_signal_connect(bench.conn, "vnc-framebuffer-update",
+                     G_CALLBACK(do_vnc_framebuffer_update), &bench);
+    g_signal_connect(bench.conn, "vnc-disconnected",
+                     G_CALLBACK(do_vnc_disconnected), &bench);
+
+    vnc_connection_open_fd(bench.conn, fds[0]);
+
+    g_main_loop_run(bench.loop);
+
+    waitpid(pid, NULL, 0);
+
+    if (!bench.initialized) {
+        g_print("Connection failed before initialization\n");
+        return EXIT_FAILURE;
+    }
+
+    secs = g_timer_elapsed(bench.timer, NULL);
+    nrects = nupdates * (BENCH_WIDTH / BENCH_RECT) * (BENCH_HEIGHT / BENCH_RECT);
+    g_print("%s: %d updates (%u seen), %u rects, %u bytes in %.3f s\n",
+            etype == VNC_CONNECTION_ENCODING_HEXTILE ? "hextile" : "rre",
+            nupdates, bench.nupdates, nrects, stream->len, secs);
+    g_print("%.1f MB/s, %.0f rects/s\n",
+            stream->len / secs / (1024 * 1024), nrects / secs);
+
+    vnc_connection_shutdown(bench.conn);
+    g_object_unref(bench.conn);
+    g_main_loop_unref(bench.loop);
+    g_timer_destroy(bench.timer);
+    g_byte_array_free(stream, TRUE);
+    g_free(bench.pixels);
+    g_free(encoding);
+
+    return bench.nupdates == (guint)nupdates ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,128 @@
+/*
+ * Vnc coroutine switch benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Ping-pongs between the main stack and a single coroutine
+ * and reports the average cost of one switch. It is built
+ * from the same coroutine sources as libgvnc, so measures
+ * whichever backend configure picked. To compare them, build
+ * with each of
+ *
+ *   --with-coroutine=asm
+ *   --with-coroutine=ucontext
+ *   --with-coroutine=gthread
+ *
+ * and run eg
+ *
+ *   ./gvncswitchbench --switches 5000000
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+
+#include <coroutine.h>
+
+#if WITH_ASM
+#define BENCH_BACKEND "asm"
+#elif WITH_UCONTEXT
+#define BENCH_BACKEND "ucontext"
+#else
+#define BENCH_BACKEND "gthread"
+#endif
+
+/* Bounces straight back to the caller until passed NULL */
+static void *bench_entry(void *arg)
+{
+    while (arg != NULL)
+        arg = coroutine_yield(arg);
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    gint nswitches = 1000000;
+    const GOptionEntry options [] = {
+        { "switches", 's', 0, G_OPTION_ARG_INT,
+          &nswitches, "Number of switches to make", "N" },
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
+    };
+    struct coroutine co;
+    GTimer *timer;
+    double secs;
+    gint i;
+
+    context = g_option_context_new("- Vnc coroutine switch benchmark");
+    g_option_context_add_main_entries(context, options, NULL);
+    g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (error) {
+        g_print("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if (nswitches < 2) {
+        g_print("Switch count must be at least 2\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&co, 0, sizeof(co));
+    co.entry = bench_entry;
+    if (coroutine_init(&co) < 0) {
+        g_print("Unable to create a coroutine\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The first entry runs the coroutine's setup, so is not timed */
+    coroutine_yieldto(&co, &co);
+
+    timer = g_timer_new();
+    for (i = 0 ; i < nswitches / 2 ; i++)
+        coroutine_yieldto(&co, &co);
+    g_timer_stop(timer);
+
+    coroutine_yieldto(&co, NULL);
+    if (!co.exited) {
+        g_print("Coroutine failed to exit\n");
+        return EXIT_FAILURE;
+    }
+
+    secs = g_timer_elapsed(timer, NULL);
+    g_print("%s: %d switches in %.3f s, %.1f ns per switch\n",
+            BENCH_BACKEND, (nswitches / 2) * 2, secs,
+            secs * 1e9 / ((nswitches / 2) * 2));
+
+    g_timer_destroy(timer);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ * End:
+ */